@@ -0,0 +1,327 @@
+// Load generator for the chat server.
+//
+// Opens N clients, registers each through the name handshake, puts them in
+// rooms or PV pairs, and then has every client send chat lines at a fixed
+// rate. Each line carries its send time; receivers use it to measure
+// end-to-end delivery latency, so the bench must run on the same host as the
+// server (or on hosts with a shared monotonic clock).
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include "asio.hpp"
+
+using namespace std;
+using asio::ip::tcp;
+using Clock = chrono::steady_clock;
+
+// ======= Config =======
+struct BenchConfig {
+    string host = "127.0.0.1";
+    string port = "8080";
+    size_t clients = 1000;
+    size_t rooms = 10;
+    double pv_ratio = 0.0;      // share of clients chatting in PV pairs
+    double rate = 10;           // lines per second per client
+    size_t payload = 64;        // bytes of filler per line
+    unsigned duration = 10;     // seconds of measured traffic
+    size_t threads = 1;
+};
+
+// stoul takes "-1" for a huge count, so signs are refused up front.
+size_t parse_count(const string& arg, const string& val) {
+    if (val.empty() || val.find_first_not_of("0123456789") != string::npos) {
+        throw runtime_error(arg + " wants a whole number, got: " + val);
+    }
+    return stoul(val);
+}
+
+BenchConfig parse_args(int argc, char* argv[]) {
+    BenchConfig cfg;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) throw runtime_error("missing value for " + arg);
+        string val = argv[++i];
+        if (arg == "--host") cfg.host = val;
+        else if (arg == "--port") cfg.port = val;
+        else if (arg == "--clients") cfg.clients = parse_count(arg, val);
+        else if (arg == "--rooms") cfg.rooms = max<size_t>(1, parse_count(arg, val));
+        else if (arg == "--pv") cfg.pv_ratio = stod(val);
+        else if (arg == "--rate") cfg.rate = stod(val);
+        else if (arg == "--payload") cfg.payload = parse_count(arg, val);
+        else if (arg == "--duration") cfg.duration = unsigned(parse_count(arg, val));
+        else if (arg == "--threads") cfg.threads = max<size_t>(1, parse_count(arg, val));
+        else throw runtime_error("unknown argument: " + arg);
+    }
+    if (cfg.clients == 0) throw runtime_error("--clients must be at least 1");
+    if (cfg.duration == 0) throw runtime_error("--duration must be at least 1 second");
+    if (!(cfg.pv_ratio >= 0 && cfg.pv_ratio <= 1)) throw runtime_error("--pv must be between 0 and 1");
+    // the send interval, 1e9 / rate ns, has to fit an int64_t
+    if (!(cfg.rate >= 0.001 && cfg.rate <= 1e9)) {
+        throw runtime_error("--rate must be between 0.001 and 1e9 lines per second");
+    }
+    return cfg;
+}
+
+BenchConfig config;
+
+// ======= Phases =======
+// Clients connect and register, then join their room or PV, then send for
+// the measured window. Lines sent outside the window are not counted.
+enum class Phase { Setup, Running, Draining };
+
+atomic<Phase> phase{Phase::Setup};
+atomic<size_t> registered{0};
+atomic<size_t> joined{0};
+atomic<size_t> failed{0};
+atomic<bool> start_joining{false};
+
+const string_view tag = "#b ";
+
+int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// ======= Client =======
+class BenchClient : public enable_shared_from_this<BenchClient> {
+public:
+    BenchClient(asio::io_context& io, size_t index, string name, string context_cmd)
+        : socket_(io), timer_(io), index_(index),
+          name_(std::move(name)), context_cmd_(std::move(context_cmd)),
+          filler_(config.payload, 'x') {}
+
+    void start(const tcp::resolver::results_type& endpoints) {
+        auto self = shared_from_this();
+        asio::async_connect(socket_, endpoints,
+            [this, self](std::error_code ec, const tcp::endpoint&) {
+                if (ec) {
+                    ++failed;
+                    return;
+                }
+                socket_.set_option(tcp::no_delay(true));
+                send(name_ + "\n");
+                do_read();
+            });
+    }
+
+    // Counters are only touched by the client's own thread and read after
+    // the io threads have stopped.
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t bytes_in = 0;
+    vector<int64_t> latencies_ns;
+
+private:
+    void send(string line) {
+        pending_ += line;
+        if (!writing_) flush();
+    }
+
+    void flush() {
+        writing_ = true;
+        inflight_.swap(pending_);
+        pending_.clear();
+        auto self = shared_from_this();
+        asio::async_write(socket_, asio::buffer(inflight_),
+            [this, self](std::error_code ec, size_t) {
+                writing_ = false;
+                if (ec) return;
+                if (!pending_.empty()) flush();
+            });
+    }
+
+    void do_read() {
+        auto self = shared_from_this();
+        socket_.async_read_some(asio::buffer(buf_),
+            [this, self](std::error_code ec, size_t n) {
+                if (ec) return;
+                on_data(string_view(buf_, n));
+                do_read();
+            });
+    }
+
+    void on_data(string_view data) {
+        if (phase == Phase::Running) bytes_in += data.size();
+        line_.append(data.data(), data.size());
+        size_t start = 0;
+        for (size_t nl; (nl = line_.find('\n', start)) != string::npos; start = nl + 1) {
+            on_line(string_view(line_).substr(start, nl - start));
+        }
+        line_.erase(0, start);
+    }
+
+    void on_line(string_view line) {
+        size_t pos = line.find(tag);
+        if (pos != string_view::npos) {
+            int64_t sent_at = strtoll(line.data() + pos + tag.size(), nullptr, 10);
+            if (phase == Phase::Running) {
+                ++delivered;
+                latencies_ns.push_back(now_ns() - sent_at);
+            }
+            return;
+        }
+        if (state_ == State::Naming && line.find("Commands:") != string_view::npos) {
+            state_ = State::Named;
+            ++registered;
+            wait_to_join();
+        } else if (state_ == State::Joining &&
+                   (line.find("You are now in room") != string_view::npos ||
+                    line.find("Private chat with") != string_view::npos)) {
+            state_ = State::Chatting;
+            ++joined;
+            schedule_send();
+        }
+    }
+
+    // PV targets must exist before /pv, so nobody joins until every client
+    // has registered.
+    void wait_to_join() {
+        if (start_joining) {
+            state_ = State::Joining;
+            send(context_cmd_ + "\n");
+            return;
+        }
+        auto self = shared_from_this();
+        timer_.expires_after(chrono::milliseconds(20));
+        timer_.async_wait([this, self](std::error_code ec) {
+            if (!ec) wait_to_join();
+        });
+    }
+
+    // Start times are spread over one interval so clients don't send in lockstep.
+    void schedule_send() {
+        auto interval = chrono::nanoseconds(int64_t(1e9 / config.rate));
+        next_send_ = Clock::now() + chrono::nanoseconds(interval.count() * int64_t(index_ % 1000) / 1000);
+        arm(interval);
+    }
+
+    void arm(chrono::nanoseconds interval) {
+        auto self = shared_from_this();
+        timer_.expires_at(next_send_);
+        timer_.async_wait([this, self, interval](std::error_code ec) {
+            if (ec || phase == Phase::Draining) return;
+            if (phase == Phase::Running) {
+                send(string(tag) + to_string(now_ns()) + " " + filler_ + "\n");
+                ++sent;
+            }
+            next_send_ += interval;
+            arm(interval);
+        });
+    }
+
+    enum class State { Naming, Named, Joining, Chatting };
+
+    tcp::socket socket_;
+    asio::steady_timer timer_;
+    size_t index_;
+    string name_;
+    string context_cmd_;
+    string filler_;
+    State state_ = State::Naming;
+    Clock::time_point next_send_;
+
+    char buf_[8192];
+    string line_;
+    string pending_;
+    string inflight_;
+    bool writing_ = false;
+};
+
+// ======= Report =======
+double percentile(const vector<int64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = min(sorted.size() - 1, size_t(p * double(sorted.size())));
+    return double(sorted[i]) / 1000.0;
+}
+
+bool wait_for(const atomic<size_t>& counter, size_t target, chrono::seconds timeout) {
+    auto deadline = Clock::now() + timeout;
+    while (counter + failed < target) {
+        if (Clock::now() > deadline) return false;
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    return failed == 0;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        config = parse_args(argc, argv);
+
+        vector<unique_ptr<asio::io_context>> contexts;
+        vector<asio::executor_work_guard<asio::io_context::executor_type>> guards;
+        for (size_t i = 0; i < config.threads; ++i) {
+            contexts.push_back(make_unique<asio::io_context>(1));
+            guards.push_back(asio::make_work_guard(*contexts.back()));
+        }
+        vector<thread> workers;
+        for (auto& io : contexts) workers.emplace_back([&io] { io->run(); });
+
+        tcp::resolver resolver(*contexts[0]);
+        auto endpoints = resolver.resolve(config.host, config.port);
+
+        // PV clients come in pairs at the front of the list.
+        size_t pv_clients = size_t(double(config.clients) * config.pv_ratio) & ~size_t(1);
+        string prefix = "b" + to_string(now_ns() % 100000) + "_";
+        vector<shared_ptr<BenchClient>> clients;
+        for (size_t i = 0; i < config.clients; ++i) {
+            string cmd = i < pv_clients
+                ? "/pv " + prefix + to_string(i ^ 1)
+                : "/join room" + to_string(i % config.rooms);
+            auto c = make_shared<BenchClient>(*contexts[i % contexts.size()], i, prefix + to_string(i), cmd);
+            c->start(endpoints);
+            clients.push_back(c);
+            // pace connects so the server's accept backlog doesn't overflow
+            if (i % 256 == 255) this_thread::sleep_for(chrono::milliseconds(5));
+        }
+
+        auto setup_timeout = chrono::seconds(30 + config.clients / 1000);
+        if (!wait_for(registered, config.clients, setup_timeout)) {
+            throw runtime_error("only " + to_string(registered) + " of " + to_string(config.clients) +
+                                " clients registered (" + to_string(failed) + " failed)");
+        }
+        start_joining = true;
+        if (!wait_for(joined, config.clients, setup_timeout)) {
+            throw runtime_error("only " + to_string(joined) + " of " + to_string(config.clients) + " clients joined");
+        }
+
+        phase = Phase::Running;
+        auto t0 = Clock::now();
+        this_thread::sleep_for(chrono::seconds(config.duration));
+        double elapsed = chrono::duration<double>(Clock::now() - t0).count();
+        phase = Phase::Draining;
+
+        guards.clear();
+        for (auto& io : contexts) io->stop();
+        for (auto& t : workers) t.join();
+
+        uint64_t sent = 0, delivered = 0, bytes_in = 0;
+        vector<int64_t> lat;
+        for (auto& c : clients) {
+            sent += c->sent;
+            delivered += c->delivered;
+            bytes_in += c->bytes_in;
+            lat.insert(lat.end(), c->latencies_ns.begin(), c->latencies_ns.end());
+        }
+        sort(lat.begin(), lat.end());
+
+        printf("clients    %zu (%zu in PV, %zu rooms), %.1f lines/s each, %zu B payload\n",
+               config.clients, pv_clients, config.rooms, config.rate, config.payload);
+        printf("sent       %llu lines, %.0f msg/s\n", (unsigned long long)sent, double(sent) / elapsed);
+        printf("delivered  %llu lines, %.0f msg/s, %.2f MB/s fan-out\n",
+               (unsigned long long)delivered, double(delivered) / elapsed, double(bytes_in) / elapsed / 1e6);
+        printf("latency    p50 %.0f us, p99 %.0f us, p999 %.0f us, max %.0f us\n",
+               percentile(lat, 0.50), percentile(lat, 0.99), percentile(lat, 0.999),
+               lat.empty() ? 0.0 : double(lat.back()) / 1000.0);
+    } catch (const exception& e) {
+        cerr << "❌ Error: " << e.what() << "\n";
+        return 1;
+    }
+}
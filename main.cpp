@@ -1,295 +1,5044 @@
-#include <iostream>
-#include <memory>
-#include <set>
-#include <map>
-#include <string>
-#include <vector>
-#include <algorithm>
-#include "asio.hpp"
-
-using namespace std;
-using asio::ip::tcp;
-
-// ======= Globals =======
-class ChatSession;
-set<shared_ptr<ChatSession>> sessions;
-map<string, set<shared_ptr<ChatSession>>> rooms;
-map<string, shared_ptr<ChatSession>> users_by_name;
-
-const vector<string> name_colors = { "\033[36m", "\033[32m", "\033[33m", "\033[35m", "\033[34m" };
-const string reset_color = "\033[0m";
-int color_index = 0;
-
-enum class Mode { None, Room, Pv };
-
-class ChatSession : public enable_shared_from_this<ChatSession> {
-public:
-    ChatSession(tcp::socket socket)
-        : socket_(std::move(socket)),
-          has_name_(false),
-          mode_(Mode::None) {
-        color_ = name_colors[color_index % name_colors.size()];
-        color_index++;
-    }
-
-    void start() {
-        sessions.insert(shared_from_this());
-        deliver("Welcome! Please enter your name: ");
-        do_read();
-    }
-
-    void deliver(const string& msg) {
-        auto self = shared_from_this();
-        asio::async_write(
-            socket_,
-            asio::buffer(msg),
-            [this, self](std::error_code ec, size_t) {
-                if (ec) {
-                    cleanup();
-                }
-            }
-        );
-    }
-
-private:
-    void do_read() {
-        auto self = shared_from_this();
-        socket_.async_read_some(
-            asio::buffer(buf_),
-            [this, self](std::error_code ec, std::size_t length) {
-                if (!ec) {
-                    string msg(buf_, buf_ + length);
-                    trim(msg);
-                    if (msg.empty()) {
-                        do_read();
-                        return;
-                    }
-
-                    if (!has_name_) {
-                        handle_name(msg);
-                    } else {
-                        handle_command_or_message(msg);
-                    }
-
-                    do_read();
-                } else {
-                    cleanup();
-                }
-            }
-        );
-    }
-
-    void handle_name(const string& name) {
-        if (users_by_name.count(name)) {
-            deliver("Name already taken. Try another: ");
-            return;
-        }
-        name_ = name;
-        has_name_ = true;
-        users_by_name[name_] = shared_from_this();
-
-        deliver("Hi " + colored_name() + "! Commands: "
-                "/join <room>, /pv <user>, /leave, /whereami, /rooms, /users\n");
-        broadcast_all(colored_name() + " joined the server.\n");
-    }
-
-    void handle_command_or_message(const string& msg) {
-        if (starts_with(msg, "/join ")) {
-            string room = msg.substr(6);
-            switch_to_room(room);
-        } else if (starts_with(msg, "/pv ")) {
-            string target = msg.substr(4);
-            switch_to_pv(target);
-        } else if (msg == "/leave") {
-            leave_all();
-            deliver("You left all contexts. Mode: none.\n");
-        } else if (msg == "/whereami") {
-            report_whereami();
-        } else if (msg == "/rooms") {
-            list_rooms();
-        } else if (msg == "/users") {
-            list_users();
-        } else {
-            send_message(msg);
-        }
-    }
-
-    void switch_to_room(const string& room) {
-        leave_all();
-        mode_ = Mode::Room;
-        active_room_ = room;
-
-        rooms[room].insert(shared_from_this());
-
-        broadcast_room(room, colored_name() + " joined room " + room + ".\n");
-
-        deliver("You are now in room " + room + ". Type to chat here.\n");
-    }
-
-    void switch_to_pv(const string& target) {
-        if (!users_by_name.count(target)) {
-            deliver("User not found.\n");
-            return;
-        }
-        if (target == name_) {
-            deliver("You cannot start PV with yourself.\n");
-            return;
-        }
-        leave_all();
-        mode_ = Mode::Pv;
-        active_pv_ = target;
-        deliver("Private chat with " + target + " started. Type to chat.\n");
-    }
-
-    void leave_all() {
-        if (mode_ == Mode::Room && !active_room_.empty()) {
-            auto it = rooms.find(active_room_);
-            if (it != rooms.end()) {
-                it->second.erase(shared_from_this());
-                broadcast_room(active_room_, colored_name() + " left room " + active_room_ + ".\n");
-            }
-        }
-        mode_ = Mode::None;
-        active_room_.clear();
-        active_pv_.clear();
-    }
-
-    void send_message(const string& text) {
-        if (mode_ == Mode::Room && !active_room_.empty()) {
-            for (auto& s : rooms[active_room_]) {
-                if (s.get() == this) continue;
-                s->deliver(colored_name() + " [" + active_room_ + "]: " + text + "\n");
-            }
-        } else if (mode_ == Mode::Pv && !active_pv_.empty()) {
-            auto t = users_by_name[active_pv_];
-            if (t) {
-                t->deliver(colored_name() + " (PV): " + text + "\n");
-                t->deliver("You have new message in pv " + name_ + "\n");
-            } else {
-                deliver("User went offline.\n");
-            }
-        } else {
-            deliver("You are not in a room or pv. Use /join <room> or /pv <user>\n");
-        }
-    }
-
-    void report_whereami() {
-        if (mode_ == Mode::Room) {
-            deliver("You are in room: " + active_room_ + "\n");
-        } else if (mode_ == Mode::Pv) {
-            deliver("You are in pv with: " + active_pv_ + "\n");
-        } else {
-            deliver("You are in: none\n");
-        }
-    }
-
-    void list_rooms() {
-        string out = "Rooms:\n";
-        for (auto& r : rooms) {
-            out += "- " + r.first + " (" + to_string(r.second.size()) + " users)\n";
-        }
-        deliver(out);
-    }
-
-    void list_users() {
-        string out = "Users:\n";
-        for (auto& kv : users_by_name) out += "- " + kv.first + "\n";
-        deliver(out);
-    }
-
-    void broadcast_all(const string& msg) {
-        for (auto& s : sessions) s->deliver(msg);
-    }
-
-    void broadcast_room(const string& room, const string& msg) {
-        auto it = rooms.find(room);
-        if (it == rooms.end()) return;
-        for (auto& s : it->second) s->deliver(msg);
-    }
-
-    string colored_name() const {
-        return color_ + name_ + reset_color;
-    }
-
-    void cleanup() {
-        sessions.erase(shared_from_this());
-        if (!name_.empty() && users_by_name[name_] == shared_from_this()) {
-            users_by_name.erase(name_);
-        }
-        if (mode_ == Mode::Room && !active_room_.empty()) {
-            auto it = rooms.find(active_room_);
-            if (it != rooms.end()) {
-                it->second.erase(shared_from_this());
-                broadcast_room(active_room_, colored_name() + " left room " + active_room_ + ".\n");
-            }
-        }
-        mode_ = Mode::None;
-        active_room_.clear();
-        active_pv_.clear();
-        if (has_name_) {
-            broadcast_all(colored_name() + " left the server.\n");
-        }
-    }
-
-    static bool starts_with(const string& s, const string& pre) {
-        return s.rfind(pre, 0) == 0;
-    }
-
-    static void trim(string& s) {
-        s.erase(remove(s.begin(), s.end(), '\r'), s.end());
-        s.erase(remove(s.begin(), s.end(), '\n'), s.end());
-        auto not_space = [](int ch){ return !std::isspace(ch); };
-        s.erase(s.begin(), std::find_if(s.begin(), s.end(), not_space));
-        s.erase(std::find_if(s.rbegin(), s.rend(), not_space).base(), s.end());
-    }
-
-    // ======= Fields =======
-    tcp::socket socket_;
-    char buf_[2048];
-
-    // identity
-    string name_;
-    string color_;
-    bool has_name_;
-
-    // context
-    Mode mode_;
-    string active_room_;
-    string active_pv_;
-};
-
-class ChatServer {
-public:
-    ChatServer(asio::io_context& io, unsigned short port)
-        : acceptor_(io, tcp::endpoint(tcp::v4(), port)) {
-        do_accept();
-    }
-
-private:
-    void do_accept() {
-        acceptor_.async_accept(
-            [this](std::error_code ec, tcp::socket socket) {
-                if (!ec) {
-                    make_shared<ChatSession>(std::move(socket))->start();
-                }
-                do_accept();
-            }
-        );
-    }
-
-    tcp::acceptor acceptor_;
-};
-
-int main() {
-    try {
-        asio::io_context io;
-
-        ChatServer server(io, 8080);
-
-        cout << "Async Chat Server (Made by JavadInteger) is running on port \"8080\"\n";
-
-        io.run();
-    } catch (const exception& e) {
-        cerr << "❌ Error: " << e.what() << "\n";
-    }
-}
+#include <iostream>
+#include <memory>
+#include <set>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <optional>
+#include <unordered_map>
+#include <shared_mutex>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <condition_variable>
+#include <csignal>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "asio.hpp"
+#ifdef CHAT_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+// Build with CHAT_COROUTINES defined (and C++20) to run sessions on the
+// coroutine engine instead of chained callbacks.
+#if defined(CHAT_COROUTINES) && !defined(ASIO_HAS_CO_AWAIT)
+#error "CHAT_COROUTINES needs C++20 coroutine support in Asio"
+#endif
+
+using namespace std;
+using asio::ip::tcp;
+
+// ======= Config =======
+// What to do when a session's outbound queue goes over its high-water mark.
+enum class OverflowPolicy { DropOldest, DropNonPv, Disconnect };
+
+struct ServerConfig {
+    unsigned short port = 8080;
+    int backlog = asio::socket_base::max_listen_connections;
+    size_t sndbuf = 0;       // per-client socket buffer sizes; 0 = OS default
+    size_t rcvbuf = 0;
+    size_t threads = 1;      // io threads; 0 = one per hardware thread
+    unsigned short admin_port = 0;  // Prometheus /metrics endpoint; 0 = off
+    size_t max_line = 2048;  // longest accepted input line, in bytes
+    size_t max_names = 1000000;  // user names, and room names, ever seen
+    bool colors = true;      // text clients start with ANSI-colored names
+    int deflate_level = 6;          // zlib level for clients that ask (CHAT_WITH_ZLIB); 0 = refuse
+    size_t trace_sample = 0;        // trace one inbound line in N; 0 = off
+
+    // per-session outbound queue limits
+    size_t out_max_bytes = 1 << 20;
+    size_t out_max_msgs = 4096;
+    OverflowPolicy overflow = OverflowPolicy::DropOldest;
+    unsigned slow_grace_secs = 10;  // Disconnect: time allowed over the limit
+
+    // session timeouts in seconds; 0 = off
+    unsigned handshake_secs = 30;   // to send a name after connecting
+    unsigned idle_secs = 0;         // with no input at all
+    unsigned ping_secs = 0;         // ping a client silent this long
+
+    // token buckets on inbound lines, in lines per second; 0 = unlimited
+    double user_rate = 0;           // every line a session sends
+    double user_burst = 20;
+    double room_rate = 0;           // chat lines into one room, from everyone
+    double room_burst = 100;
+
+    // rooms whose chat is coalesced into one write per member per tick
+    vector<string> batch_rooms;     // "*" = every room
+    unsigned batch_ms = 5;
+    size_t batch_bytes = 16384;     // flush early once a tick holds this much
+
+    // rooms larger than this hand their fan-out to the members' own io threads
+    size_t fanout_inline = 1024;
+    size_t fanout_chunk = 256;      // recipients per handed-off chunk
+
+    size_t list_page = 50;          // entries per /rooms or /users page
+
+    // persistent room history; off unless log_dir is set
+    string log_dir;
+    size_t log_segment_bytes = 16 << 20;
+    size_t log_segments = 8;        // newest segments kept per room
+    size_t log_max_maps = 4096;     // segment mappings all room logs may hold
+    size_t history = 20;            // messages replayed on /join
+    unsigned log_commit_ms = 10;    // at most one commit per room per interval
+
+    // PV messages held for offline users; 0 turns the mailbox off
+    size_t mailbox_bytes = 64 << 10;        // per recipient
+    size_t mailbox_total_bytes = 64 << 20;  // across all recipients
+
+    // cluster mode: this node's link address and the other nodes'
+    string cluster_addr;
+    vector<string> peers;
+
+    // presence digests
+    unsigned presence_ms = 1000;
+    size_t presence_names = 20;     // names listed per direction per digest
+
+    // shutdown and restart
+    unsigned drain_secs = 5;        // for outboxes to flush before exiting
+    string handoff_path;            // Unix socket a new process takes over through
+    string takeover_path;           // take over from the process listening here
+
+    bool batched(string_view room) const {
+        for (auto& b : batch_rooms) if (b == "*" || b == room) return true;
+        return false;
+    }
+};
+
+OverflowPolicy parse_policy(const string& s) {
+    if (s == "drop-oldest") return OverflowPolicy::DropOldest;
+    if (s == "drop-non-pv") return OverflowPolicy::DropNonPv;
+    if (s == "disconnect") return OverflowPolicy::Disconnect;
+    throw runtime_error("unknown overflow policy: " + s);
+}
+
+bool parse_switch(const string& s) {
+    if (s == "on") return true;
+    if (s == "off") return false;
+    throw runtime_error("expected on or off, got: " + s);
+}
+
+ServerConfig parse_args(int argc, char* argv[]) {
+    ServerConfig cfg;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            cfg.port = static_cast<unsigned short>(stoul(argv[++i]));
+        } else if (arg == "--backlog" && i + 1 < argc) {
+            cfg.backlog = max(1, stoi(argv[++i]));
+        } else if (arg == "--sndbuf" && i + 1 < argc) {
+            cfg.sndbuf = stoul(argv[++i]);
+        } else if (arg == "--rcvbuf" && i + 1 < argc) {
+            cfg.rcvbuf = stoul(argv[++i]);
+        } else if (arg == "--cluster" && i + 1 < argc) {
+            cfg.cluster_addr = argv[++i];
+        } else if (arg == "--peer" && i + 1 < argc) {
+            cfg.peers.push_back(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            cfg.threads = stoul(argv[++i]);
+        } else if (arg == "--admin-port" && i + 1 < argc) {
+            cfg.admin_port = static_cast<unsigned short>(stoul(argv[++i]));
+        } else if (arg == "--max-line" && i + 1 < argc) {
+            cfg.max_line = stoul(argv[++i]);
+        } else if (arg == "--max-names" && i + 1 < argc) {
+            cfg.max_names = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--colors" && i + 1 < argc) {
+            cfg.colors = parse_switch(argv[++i]);
+        } else if (arg == "--trace-sample" && i + 1 < argc) {
+            cfg.trace_sample = stoul(argv[++i]);
+        } else if (arg == "--deflate-level" && i + 1 < argc) {
+            cfg.deflate_level = clamp(stoi(argv[++i]), 0, 9);
+        } else if (arg == "--out-max-bytes" && i + 1 < argc) {
+            cfg.out_max_bytes = stoul(argv[++i]);
+        } else if (arg == "--out-max-msgs" && i + 1 < argc) {
+            cfg.out_max_msgs = stoul(argv[++i]);
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            cfg.overflow = parse_policy(argv[++i]);
+        } else if (arg == "--slow-grace" && i + 1 < argc) {
+            cfg.slow_grace_secs = stoul(argv[++i]);
+        } else if (arg == "--handshake-timeout" && i + 1 < argc) {
+            cfg.handshake_secs = stoul(argv[++i]);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            cfg.idle_secs = stoul(argv[++i]);
+        } else if (arg == "--ping" && i + 1 < argc) {
+            cfg.ping_secs = stoul(argv[++i]);
+        } else if (arg == "--user-rate" && i + 1 < argc) {
+            cfg.user_rate = stod(argv[++i]);
+        } else if (arg == "--user-burst" && i + 1 < argc) {
+            cfg.user_burst = max(1.0, stod(argv[++i]));
+        } else if (arg == "--room-rate" && i + 1 < argc) {
+            cfg.room_rate = stod(argv[++i]);
+        } else if (arg == "--room-burst" && i + 1 < argc) {
+            cfg.room_burst = max(1.0, stod(argv[++i]));
+        } else if (arg == "--batch-room" && i + 1 < argc) {
+            cfg.batch_rooms.push_back(argv[++i]);
+        } else if (arg == "--batch-ms" && i + 1 < argc) {
+            cfg.batch_ms = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--batch-bytes" && i + 1 < argc) {
+            cfg.batch_bytes = stoul(argv[++i]);
+        } else if (arg == "--fanout-inline" && i + 1 < argc) {
+            cfg.fanout_inline = stoul(argv[++i]);
+        } else if (arg == "--fanout-chunk" && i + 1 < argc) {
+            cfg.fanout_chunk = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            cfg.log_dir = argv[++i];
+        } else if (arg == "--log-segment-bytes" && i + 1 < argc) {
+            cfg.log_segment_bytes = max(size_t(1) << 16, size_t(stoul(argv[++i])));
+        } else if (arg == "--log-segments" && i + 1 < argc) {
+            cfg.log_segments = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--log-max-maps" && i + 1 < argc) {
+            cfg.log_max_maps = stoul(argv[++i]);
+        } else if (arg == "--log-commit-ms" && i + 1 < argc) {
+            cfg.log_commit_ms = stoul(argv[++i]);
+        } else if (arg == "--history" && i + 1 < argc) {
+            cfg.history = stoul(argv[++i]);
+        } else if (arg == "--list-page" && i + 1 < argc) {
+            cfg.list_page = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--mailbox-bytes" && i + 1 < argc) {
+            cfg.mailbox_bytes = stoul(argv[++i]);
+        } else if (arg == "--mailbox-total-bytes" && i + 1 < argc) {
+            cfg.mailbox_total_bytes = stoul(argv[++i]);
+        } else if (arg == "--presence-ms" && i + 1 < argc) {
+            cfg.presence_ms = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--presence-names" && i + 1 < argc) {
+            cfg.presence_names = stoul(argv[++i]);
+        } else if (arg == "--drain-secs" && i + 1 < argc) {
+            cfg.drain_secs = stoul(argv[++i]);
+        } else if (arg == "--handoff" && i + 1 < argc) {
+            cfg.handoff_path = argv[++i];
+        } else if (arg == "--takeover" && i + 1 < argc) {
+            cfg.takeover_path = argv[++i];
+        } else {
+            throw runtime_error("unknown argument: " + arg);
+        }
+    }
+    if (cfg.threads == 0) cfg.threads = max(1u, thread::hardware_concurrency());
+    return cfg;
+}
+
+// ======= Memory pools =======
+// Fixed-size block pool carved out of 64 KiB slabs. Each thread keeps a small
+// cache of free blocks in front of the shared free list, so the common
+// allocate/free pair never takes the lock. Slabs are kept for the life of the
+// process.
+template <size_t BlockSize>
+class BlockPool {
+public:
+    static void* allocate() {
+        Cache& c = cache_;
+        if (c.blocks.empty()) instance().refill(c);
+        void* p = c.blocks.back();
+        c.blocks.pop_back();
+        return p;
+    }
+
+    static void deallocate(void* p) {
+        Cache& c = cache_;
+        c.blocks.push_back(p);
+        if (c.blocks.size() >= 2 * batch) instance().drain(c, batch);
+    }
+
+private:
+    static constexpr size_t batch = 64;
+    static constexpr size_t slab_size = 64 * 1024;
+
+    struct Cache {
+        vector<void*> blocks;
+        ~Cache() { instance().drain(*this, blocks.size()); }
+    };
+
+    static BlockPool& instance() {
+        static BlockPool pool;
+        return pool;
+    }
+
+    void refill(Cache& c) {
+        lock_guard<mutex> lock(m_);
+        if (free_.empty()) {
+            char* slab = static_cast<char*>(::operator new(max(slab_size, BlockSize)));
+            for (size_t off = 0; off + BlockSize <= max(slab_size, BlockSize); off += BlockSize) {
+                free_.push_back(slab + off);
+            }
+        }
+        size_t n = min(batch, free_.size());
+        c.blocks.insert(c.blocks.end(), free_.end() - n, free_.end());
+        free_.resize(free_.size() - n);
+    }
+
+    void drain(Cache& c, size_t n) {
+        lock_guard<mutex> lock(m_);
+        free_.insert(free_.end(), c.blocks.end() - n, c.blocks.end());
+        c.blocks.resize(c.blocks.size() - n);
+    }
+
+    mutex m_;
+    vector<void*> free_;
+    static thread_local Cache cache_;
+};
+
+template <size_t BlockSize>
+thread_local typename BlockPool<BlockSize>::Cache BlockPool<BlockSize>::cache_;
+
+// Size-classed front end over the block pools: 64 B .. 16 KiB in powers of
+// two. Anything bigger goes straight to operator new.
+constexpr size_t pool_max_block = 16384;
+
+inline size_t pool_size_class(size_t n) {
+    size_t cls = 0;
+    for (size_t sz = 64; sz < n; sz <<= 1) ++cls;
+    return cls;
+}
+
+inline void* pool_allocate(size_t n) {
+    using Alloc = void* (*)();
+    static const Alloc table[] = {
+        &BlockPool<64>::allocate, &BlockPool<128>::allocate, &BlockPool<256>::allocate,
+        &BlockPool<512>::allocate, &BlockPool<1024>::allocate, &BlockPool<2048>::allocate,
+        &BlockPool<4096>::allocate, &BlockPool<8192>::allocate, &BlockPool<16384>::allocate,
+    };
+    if (n > pool_max_block) return ::operator new(n);
+    return table[pool_size_class(n)]();
+}
+
+inline void pool_deallocate(void* p, size_t n) {
+    using Free = void (*)(void*);
+    static const Free table[] = {
+        &BlockPool<64>::deallocate, &BlockPool<128>::deallocate, &BlockPool<256>::deallocate,
+        &BlockPool<512>::deallocate, &BlockPool<1024>::deallocate, &BlockPool<2048>::deallocate,
+        &BlockPool<4096>::deallocate, &BlockPool<8192>::deallocate, &BlockPool<16384>::deallocate,
+    };
+    if (n > pool_max_block) {
+        ::operator delete(p);
+        return;
+    }
+    table[pool_size_class(n)](p);
+}
+
+// Standard allocator over the size-classed pools, used for sessions (via
+// allocate_shared), frames and per-session buffers.
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) { return static_cast<T*>(pool_allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) noexcept { pool_deallocate(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+// Storage for the one outstanding operation of a kind (one read, one write)
+// on a session, so those completion handlers don't hit malloc. Only the
+// session's own thread uses it.
+class HandlerMemory {
+public:
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(size_t size) {
+        if (!in_use_ && size <= sizeof(storage_)) {
+            in_use_ = true;
+            return &storage_;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* p) {
+        if (p == &storage_) {
+            in_use_ = false;
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+private:
+    alignas(max_align_t) unsigned char storage_[1024];
+    bool in_use_ = false;
+};
+
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& mem) : memory_(mem) {}
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    T* allocate(size_t n) const { return static_cast<T*>(memory_.allocate(sizeof(T) * n)); }
+    void deallocate(T* p, size_t) const { memory_.deallocate(p); }
+
+    bool operator==(const HandlerAllocator& other) const noexcept { return &memory_ == &other.memory_; }
+    bool operator!=(const HandlerAllocator& other) const noexcept { return &memory_ != &other.memory_; }
+
+private:
+    template <typename> friend class HandlerAllocator;
+    HandlerMemory& memory_;
+};
+
+// Wraps a completion handler so asio allocates its operation state from a
+// HandlerMemory instead of the heap.
+template <typename Handler>
+class AllocHandler {
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    AllocHandler(HandlerMemory& mem, Handler h) : memory_(mem), handler_(std::move(h)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+
+    template <typename... Args>
+    void operator()(Args&&... args) { handler_(std::forward<Args>(args)...); }
+
+private:
+    HandlerMemory& memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+AllocHandler<decay_t<Handler>> make_alloc_handler(HandlerMemory& mem, Handler&& h) {
+    return AllocHandler<decay_t<Handler>>(mem, std::forward<Handler>(h));
+}
+
+// ======= IO pool =======
+// One io_context per worker thread. A session lives on exactly one context,
+// so its own state is only ever touched from that thread.
+thread_local size_t this_shard = SIZE_MAX;   // index of the context this thread runs
+
+class IoContextPool {
+public:
+    explicit IoContextPool(size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            contexts_.push_back(make_unique<asio::io_context>(1));
+            guards_.push_back(asio::make_work_guard(*contexts_.back()));
+        }
+    }
+
+    asio::io_context& at(size_t i) { return *contexts_[i % contexts_.size()]; }
+    asio::io_context& next() { return at(next_++); }
+    size_t next_index() { return next_++ % contexts_.size(); }
+    size_t size() const { return contexts_.size(); }
+
+    // Runs context 0 on the calling thread and the rest on worker threads.
+    void run() {
+        vector<thread> workers;
+        for (size_t i = 1; i < contexts_.size(); ++i) {
+            workers.emplace_back([this, i] {
+                this_shard = i;
+                contexts_[i]->run();
+            });
+        }
+        this_shard = 0;
+        contexts_[0]->run();
+        for (auto& t : workers) t.join();
+    }
+
+    // Makes run() return on every thread, pending work or not.
+    void stop() {
+        guards_.clear();
+        for (auto& c : contexts_) c->stop();
+    }
+
+private:
+    vector<unique_ptr<asio::io_context>> contexts_;
+    vector<asio::executor_work_guard<asio::io_context::executor_type>> guards_;
+    size_t next_ = 0;
+};
+
+// Per-io-thread hashed timing wheel. Entries sit in slot deadline % slots
+// and fire on the tick that reaches their deadline; scheduling is a push and
+// each tick only visits one slot, however many connections there are.
+// Deadlines only ever move later (e.g. an idle timeout after every read), so
+// owners keep one entry and push it out lazily: when it fires early,
+// T::on_wheel() checks the real deadline and schedules itself again.
+template <typename T>
+class TimingWheel {
+public:
+    TimingWheel(asio::io_context& io, chrono::milliseconds tick, size_t slots = 512)
+        : timer_(io), tick_(tick), slots_(slots) {
+        arm();
+    }
+
+    uint64_t now() const { return now_; }
+
+    // Owner's thread only. Deadlines are in ticks from now().
+    void schedule(weak_ptr<T> owner, uint64_t deadline) {
+        deadline = max(deadline, now_ + 1);
+        slots_[deadline % slots_.size()].push_back({std::move(owner), deadline});
+    }
+
+private:
+    struct Entry {
+        weak_ptr<T> owner;
+        uint64_t deadline;
+    };
+
+    void arm() {
+        timer_.expires_after(tick_);
+        timer_.async_wait([this](asio::error_code ec) {
+            if (ec) return;
+            advance();
+            arm();
+        });
+    }
+
+    void advance() {
+        ++now_;
+        auto& slot = slots_[now_ % slots_.size()];
+        due_.clear();
+        size_t keep = 0;
+        for (auto& e : slot) {
+            if (e.deadline > now_) {
+                slot[keep++] = std::move(e);   // a later lap of the wheel
+            } else {
+                due_.push_back(std::move(e.owner));
+            }
+        }
+        slot.resize(keep);
+        for (auto& w : due_) {
+            if (auto owner = w.lock()) owner->on_wheel();
+        }
+    }
+
+    asio::steady_timer timer_;
+    chrono::milliseconds tick_;
+    vector<vector<Entry>> slots_;
+    vector<weak_ptr<T>> due_;
+    uint64_t now_ = 0;
+};
+
+// ======= Symbols =======
+// Interned names. Id 0 means "no symbol".
+using SymbolId = uint32_t;
+using RoomId = SymbolId;
+
+// Open-addressing hash map from SymbolId to V with linear probing and
+// backward-shift deletion, so there are no tombstones to clean up.
+template <typename V>
+class FlatMap {
+public:
+    FlatMap() : slots_(16) {}
+
+    V* find(SymbolId key) {
+        for (size_t i = ideal(key);; i = (i + 1) & mask()) {
+            if (slots_[i].key == key) return &slots_[i].value;
+            if (slots_[i].key == 0) return nullptr;
+        }
+    }
+
+    V& insert_or_assign(SymbolId key, V value) {
+        if ((size_ + 1) * 4 > slots_.size() * 3) grow();
+        size_t i = ideal(key);
+        while (slots_[i].key != 0 && slots_[i].key != key) i = (i + 1) & mask();
+        if (slots_[i].key == 0) ++size_;
+        slots_[i].key = key;
+        slots_[i].value = std::move(value);
+        return slots_[i].value;
+    }
+
+    bool erase(SymbolId key) {
+        size_t i = ideal(key);
+        while (slots_[i].key != key) {
+            if (slots_[i].key == 0) return false;
+            i = (i + 1) & mask();
+        }
+        for (size_t j = (i + 1) & mask(); slots_[j].key != 0; j = (j + 1) & mask()) {
+            size_t k = ideal(slots_[j].key);
+            // move j back into the hole at i unless its ideal slot lies in (i, j]
+            bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if (!stays) {
+                slots_[i] = std::move(slots_[j]);
+                i = j;
+            }
+        }
+        slots_[i] = Slot{};
+        --size_;
+        return true;
+    }
+
+    template <typename F>
+    void for_each(F&& f) {
+        for (auto& slot : slots_) {
+            if (slot.key != 0) f(slot.key, slot.value);
+        }
+    }
+
+    size_t size() const { return size_; }
+
+private:
+    struct Slot {
+        SymbolId key = 0;
+        V value{};
+    };
+
+    size_t mask() const { return slots_.size() - 1; }
+    size_t ideal(SymbolId key) const {
+        return size_t((uint64_t(key) * 0x9E3779B97F4A7C15ull) >> 32) & mask();
+    }
+
+    void grow() {
+        vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        size_ = 0;
+        for (auto& slot : old) {
+            if (slot.key != 0) insert_or_assign(slot.key, std::move(slot.value));
+        }
+    }
+
+    vector<Slot> slots_;
+    size_t size_ = 0;
+};
+
+// Interns names into compact ids. Ids are never reused, so a session can
+// keep one across reconnects of the same name; instead of evicting, a table
+// stops taking new names once it holds limit of them. Lookups take a shared
+// lock.
+class SymbolTable {
+public:
+    // Returns 0 for a new name once the table is full.
+    SymbolId intern(string_view s, size_t limit) {
+        {
+            shared_lock<shared_mutex> lock(m_);
+            if (SymbolId id = find_locked(s)) return id;
+        }
+        unique_lock<shared_mutex> lock(m_);
+        if (SymbolId id = find_locked(s)) return id;
+        if (names_.size() >= limit) return 0;
+        if ((names_.size() + 1) * 2 > index_.size()) rehash(index_.size() * 2);
+        names_.emplace_back(s);
+        SymbolId id = SymbolId(names_.size());
+        place(id);
+        return id;
+    }
+
+    // Returns 0 for names that were never interned.
+    SymbolId find(string_view s) const {
+        shared_lock<shared_mutex> lock(m_);
+        return find_locked(s);
+    }
+
+    // deque never moves its elements, so the reference outlives the lock.
+    const string& name(SymbolId id) const {
+        shared_lock<shared_mutex> lock(m_);
+        return names_[id - 1];
+    }
+
+private:
+    SymbolId find_locked(string_view s) const {
+        size_t mask = index_.size() - 1;
+        for (size_t i = hash<string_view>{}(s) & mask;; i = (i + 1) & mask) {
+            SymbolId id = index_[i];
+            if (id == 0) return 0;
+            if (names_[id - 1] == s) return id;
+        }
+    }
+
+    void place(SymbolId id) {
+        size_t mask = index_.size() - 1;
+        size_t i = hash<string_view>{}(names_[id - 1]) & mask;
+        while (index_[i] != 0) i = (i + 1) & mask;
+        index_[i] = id;
+    }
+
+    void rehash(size_t n) {
+        index_.assign(n, 0);
+        for (SymbolId id = 1; id <= names_.size(); ++id) place(id);
+    }
+
+    mutable shared_mutex m_;
+    deque<string> names_;              // names_[id - 1]
+    vector<SymbolId> index_ = vector<SymbolId>(64);
+};
+
+// ======= Globals =======
+class ChatSession;
+struct Room;
+
+ServerConfig config;
+unique_ptr<IoContextPool> io_pool;
+vector<unique_ptr<TimingWheel<ChatSession>>> wheels;   // one per io context when timeouts are on
+
+SymbolTable user_names;
+
+// Every open session, for draining and handoffs; shared by all io threads.
+mutex sessions_mutex;
+set<shared_ptr<ChatSession>> sessions;
+
+// Signed-in users by name id, in shards keyed by id like Presence, so PV
+// lookups on different threads rarely meet on one lock.
+class UserRegistry {
+public:
+    using Users = FlatMap<shared_ptr<ChatSession>>;
+
+    shared_ptr<ChatSession> find(SymbolId id) {
+        Shard& shard = shards_[id % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        auto* s = shard.users.find(id);
+        return s ? *s : nullptr;
+    }
+
+    // Runs f on the map holding id with its shard locked, so a check and
+    // the change it allows happen as one step.
+    template <typename F>
+    auto with(SymbolId id, F&& f) {
+        Shard& shard = shards_[id % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        return f(shard.users);
+    }
+
+    vector<SymbolId> ids() {
+        vector<SymbolId> out;
+        for (auto& shard : shards_) {
+            lock_guard<mutex> lock(shard.m);
+            shard.users.for_each([&](SymbolId id, shared_ptr<ChatSession>&) { out.push_back(id); });
+        }
+        return out;
+    }
+
+private:
+    struct Shard {
+        mutex m;
+        Users users;
+    };
+    array<Shard, 16> shards_;
+};
+
+UserRegistry user_registry;
+
+// Set once the process is draining or handing off; from then on leaves are
+// not announced, so shutting down doesn't flood the remaining clients.
+atomic<bool> draining{false};
+
+const vector<string> name_colors = { "\033[36m", "\033[32m", "\033[33m", "\033[35m", "\033[34m" };
+const string reset_color = "\033[0m";
+atomic<int> color_index{0};
+
+enum class Mode { None, Room, Pv };
+
+using Clock = chrono::steady_clock;
+
+// An encoded outbound line. Frames are immutable once built, so a fan-out
+// formats the text once and every recipient's queue shares the same buffer.
+// Both the bytes and the shared_ptr control block come from the pools.
+using FrameString = basic_string<char, char_traits<char>, PoolAllocator<char>>;
+using SharedString = shared_ptr<const FrameString>;
+
+// A frame is written as a gather list: its own head bytes, then an optional
+// shared prefix (e.g. a sender's "name [room]: " tag), then an optional body
+// borrowed from elsewhere (the sender's receive buffer, which body_owner
+// keeps alive), then a static tail. Long chat text is never copied between
+// the socket read and the socket write; short text is copied once, since a
+// queued frame that borrows keeps the whole receive buffer alive.
+struct FrameData {
+    FrameString head;
+    SharedString prefix;
+    string_view body;
+    shared_ptr<const void> body_owner;
+    string_view tail;           // static storage only, e.g. "\n"
+    Clock::time_point origin;   // when the inbound line that caused it was read
+    uint32_t trace = 0;         // the sampled line it belongs to, if any (see Tracing)
+    bool deflated = false;      // already a deflate record (see Compression)
+    size_t pinned = 0;          // memory body_owner holds besides body
+
+    size_t size() const {
+        return head.size() + (prefix ? prefix->size() : 0) + body.size() + tail.size();
+    }
+
+    // What a queue holding the frame keeps alive; queue limits count this.
+    size_t footprint() const { return size() + pinned; }
+
+    // Copies the frame to out, leaving off its first skip bytes (at most the
+    // head). Returns the end of the copy.
+    char* copy_to(char* out, size_t skip = 0) const {
+        auto put = [&](const char* p, size_t n) {
+            if (n) memcpy(out, p, n);   // empty pieces may have no storage
+            out += n;
+        };
+        put(head.data() + skip, head.size() - skip);
+        if (prefix) put(prefix->data(), prefix->size());
+        put(body.data(), body.size());
+        put(tail.data(), tail.size());
+        return out;
+    }
+
+    void append_to(FrameString& out) const {
+        out.append(head);
+        if (prefix) out.append(*prefix);
+        out.append(body.data(), body.size());
+        out.append(tail.data(), tail.size());
+    }
+
+    template <typename Buffers>
+    void gather(Buffers& out) const {
+        if (!head.empty()) out.push_back(asio::buffer(head));
+        if (prefix && !prefix->empty()) out.push_back(asio::buffer(*prefix));
+        if (!body.empty()) out.push_back(asio::buffer(body.data(), body.size()));
+        if (!tail.empty()) out.push_back(asio::buffer(tail.data(), tail.size()));
+    }
+};
+
+using Frame = shared_ptr<const FrameData>;
+
+// Read time of the line currently being dispatched on this thread; frames
+// built outside a dispatch take their own creation time.
+thread_local Clock::time_point dispatch_origin{};
+thread_local uint32_t dispatch_trace = 0;   // and its trace, if it was sampled
+
+struct DispatchScope {
+    explicit DispatchScope(Clock::time_point t) { dispatch_origin = t; }
+    ~DispatchScope() { dispatch_origin = {}; }
+};
+
+// Wraps already rendered bytes in a frame.
+Frame adopt_frame(FrameString text) {
+    auto origin = dispatch_origin == Clock::time_point{} ? Clock::now() : dispatch_origin;
+    return allocate_shared<const FrameData>(PoolAllocator<FrameData>(),
+                                            FrameData{std::move(text), nullptr, {}, nullptr, {}, origin, dispatch_trace});
+}
+
+// Builds a frame from an optional fixed header plus its pieces, with a
+// single, exactly sized allocation.
+Frame make_frame(string_view head, initializer_list<string_view> parts) {
+    size_t total = head.size();
+    for (auto p : parts) total += p.size();
+    FrameString text;
+    text.reserve(total);
+    text.append(head.data(), head.size());
+    for (auto p : parts) text.append(p.data(), p.size());
+    return adopt_frame(std::move(text));
+}
+
+// A body for frames to borrow, the owner keeping it alive, and how much
+// more than the body that owner holds.
+struct BodyRef {
+    string_view bytes;
+    shared_ptr<const void> owner;
+    size_t pinned = 0;
+};
+
+// A frame that forwards body without copying it: [head] prefix body tail.
+Frame make_forward(string_view head, SharedString prefix, BodyRef body, string_view tail) {
+    auto origin = dispatch_origin == Clock::time_point{} ? Clock::now() : dispatch_origin;
+    return allocate_shared<const FrameData>(
+        PoolAllocator<FrameData>(),
+        FrameData{FrameString(head), std::move(prefix), body.bytes, std::move(body.owner), tail, origin,
+                  dispatch_trace, false, body.pinned});
+}
+
+SharedString make_shared_string(initializer_list<string_view> parts) {
+    FrameString s;
+    for (auto p : parts) s.append(p.data(), p.size());
+    return allocate_shared<const FrameString>(PoolAllocator<FrameString>(), std::move(s));
+}
+
+Frame make_frame(initializer_list<string_view> parts) {
+    return make_frame({}, parts);
+}
+
+Frame make_frame(string_view text) {
+    return make_frame({}, {text});
+}
+
+// ======= Wire protocols =======
+// Clients speak the line-oriented text protocol unless the first bytes they
+// send are binary_magic. The server then echoes the magic, and everything
+// after it in both directions is binary packets. Anything the client receives
+// before the echo (the text welcome prompt) is to be skipped.
+//
+// A packet is a fixed 10-byte header followed by the payload:
+//   opcode (1) | flags (1) | id (4, big-endian) | payload length (4, big-endian)
+// id is a room id or user id depending on the opcode.
+enum class Protocol : uint8_t { Text, Binary };
+
+// What a session is sent: text with ANSI-colored names, the same text
+// without escape codes (for clients that aren't terminals), or packets.
+enum class Render : uint8_t { Ansi, Plain, Binary };
+
+enum class Op : uint8_t {
+    // client -> server
+    Name = 0x01, Join = 0x02, Pv = 0x03, Leave = 0x04, Chat = 0x05,
+    WhereAmI = 0x06, Rooms = 0x07, Users = 0x08, Stats = 0x09,
+    Presence = 0x0A,  // payload: "on" or "off"
+    Pong = 0x0B,      // reply to Ping; any input counts as activity
+    // node <-> node, on cluster links only
+    NodeHello = 0x40,    // payload: str(node address)
+    NodeRoom = 0x41,     // flags: 1 = has members, 0 = has none; payload: str(room)
+    NodeUser = 0x42,     // flags: 1 = signed in, 0 = gone; payload: str(user)
+    NodeRoomMsg = 0x43,  // payload: str(room), str(sender), text
+    NodePv = 0x44,       // payload: str(target user), str(sender), text
+    // server -> client
+    Welcome = 0x80,   // id: your user id, payload: your name
+    Info = 0x81,      // payload: human-readable text
+    RoomMsg = 0x82,   // id: room id, payload: u8 name length, sender name, text
+    PvMsg = 0x83,     // id: sender user id, payload: u8 name length, sender name, text
+    Joined = 0x84,    // id: room id, payload: room name
+    Ping = 0x85,      // sent after ping_secs of silence when enabled
+    Error = 0x8F,     // payload: human-readable text
+};
+
+constexpr size_t packet_header_size = 10;
+constexpr string_view binary_magic("\0CB\1", 4);
+
+struct PacketHeader {
+    Op op;
+    uint8_t flags;
+    uint32_t id;
+    uint32_t length;
+};
+
+inline void put_u32(char* p, uint32_t v) {
+    p[0] = char(v >> 24);
+    p[1] = char(v >> 16);
+    p[2] = char(v >> 8);
+    p[3] = char(v);
+}
+
+inline uint32_t get_u32(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return uint32_t(b[0]) << 24 | uint32_t(b[1]) << 16 | uint32_t(b[2]) << 8 | uint32_t(b[3]);
+}
+
+Frame make_packet(Op op, uint32_t id, initializer_list<string_view> payload) {
+    size_t length = 0;
+    for (auto p : payload) length += p.size();
+    char head[packet_header_size];
+    head[0] = char(op);
+    head[1] = 0;
+    put_u32(head + 2, id);
+    put_u32(head + 6, uint32_t(length));
+    return make_frame(string_view(head, sizeof(head)), payload);
+}
+
+// A RoomMsg/PvMsg packet whose payload is a shared sender prefix plus a
+// borrowed body.
+Frame make_forward_packet(Op op, uint32_t id, SharedString prefix, BodyRef body) {
+    size_t prefix_size = prefix ? prefix->size() : 0;
+    char head[packet_header_size];
+    head[0] = char(op);
+    head[1] = 0;
+    put_u32(head + 2, id);
+    put_u32(head + 6, uint32_t(prefix_size + body.bytes.size()));
+    return make_forward(string_view(head, sizeof(head)), std::move(prefix), std::move(body), {});
+}
+
+// One message rendered for each kind of recipient. A variant is left empty
+// when no recipient needs it, or when the message has no equivalent in that
+// protocol; recipients whose variant is empty skip the message. Only text
+// with colors in it has a separate plain variant; without one, plain
+// recipients get the text as is.
+struct Message {
+    Frame text;
+    Frame plain;
+    Frame binary;
+    // the same as deflate records, made by room fan-outs with deflate members
+    Frame ztext;
+    Frame zplain;
+    Frame zbinary;
+
+    const Frame& for_render(Render r) const {
+        if (r == Render::Binary) return binary;
+        return r == Render::Plain && plain ? plain : text;
+    }
+
+    uint32_t trace() const {
+        for (auto* f : {&text, &plain, &binary}) {
+            if (*f && (*f)->trace) return (*f)->trace;
+        }
+        return 0;
+    }
+
+    // The deflated variant where there is one; enqueue() deflates the rest.
+    const Frame& for_render(Render r, bool deflate) const {
+        if (deflate) {
+            const Frame& z = r == Render::Binary ? zbinary : r == Render::Plain && plain ? zplain : ztext;
+            if (z) return z;
+        }
+        return for_render(r);
+    }
+};
+
+// Text rendered with colors (replayed history, say) for a plain client:
+// drops every ESC '[' ... sequence.
+Frame strip_ansi(const Frame& frame) {
+    FrameString in, out;
+    frame->append_to(in);
+    out.reserve(in.size());
+    for (size_t i = 0; i < in.size(); ++i) {
+        if (in[i] == '\033' && i + 1 < in.size() && in[i + 1] == '[') {
+            for (i += 2; i < in.size() && (in[i] < 0x40 || in[i] > 0x7E); ++i) {}
+            continue;
+        }
+        out += in[i];
+    }
+    return adopt_frame(std::move(out));
+}
+
+// Server text in both renderings: the raw lines, or an Info packet.
+Message info_message(string_view text) {
+    Message m;
+    m.text = make_frame(text);
+    if (!text.empty() && text.back() == '\n') text.remove_suffix(1);
+    m.binary = make_packet(Op::Info, 0, {text});
+    return m;
+}
+
+// Online sessions speaking the binary protocol; fan-outs skip building the
+// binary variant while there are none.
+atomic<size_t> binary_sessions{0};
+
+// Traffic class of a queued frame, used when shedding load for a slow reader.
+// Control is a direct reply to the session itself.
+enum class Traffic { Control, Room, Broadcast, Pv };
+
+// Outbound backpressure counters, one per overflow policy.
+struct BackpressureStats {
+    atomic<uint64_t> dropped_oldest{0};
+    atomic<uint64_t> dropped_non_pv{0};
+    atomic<uint64_t> dropped_bytes{0};
+    atomic<uint64_t> slow_disconnects{0};
+};
+
+BackpressureStats backpressure_stats;
+
+// ======= Metrics =======
+// Hot-path counters live in per-thread blocks that only their own thread
+// writes, so an increment is a plain relaxed load/store with no lock prefix.
+// The admin endpoint sums the blocks of all threads when it is scraped.
+struct Counter {
+    atomic<uint64_t> v{0};
+    void add(uint64_t n = 1) { v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed); }
+    uint64_t get() const { return v.load(memory_order_relaxed); }
+};
+
+struct Gauge {
+    atomic<int64_t> v{0};
+    void add(int64_t n) { v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed); }
+    int64_t get() const { return v.load(memory_order_relaxed); }
+};
+
+// Log-linear histogram in the style of HdrHistogram: each power of two is
+// split into 8 linear sub-buckets, so a bucket is within 12.5% of the value.
+class Histogram {
+public:
+    static constexpr size_t sub_buckets = 8;
+    static constexpr size_t buckets = 8 * 40;
+
+    void record(uint64_t v) {
+        counts_[index(v)].add();
+        sum_.add(v);
+    }
+
+    static size_t index(uint64_t v) {
+        if (v < sub_buckets) return v;
+        size_t mag = 0;
+        while (v >> (mag + 1)) ++mag;
+        size_t sub = (v >> (mag - 3)) & (sub_buckets - 1);
+        return min(buckets - 1, (mag - 2) * sub_buckets + sub);
+    }
+
+    // Exclusive upper bound of the values counted in bucket i.
+    static uint64_t upper_bound(size_t i) {
+        if (i < sub_buckets) return i + 1;
+        size_t mag = i / sub_buckets + 2;
+        return (sub_buckets + 1 + i % sub_buckets) << (mag - 3);
+    }
+
+    // Adds this histogram's counts into a plain snapshot.
+    void merge_into(vector<uint64_t>& counts, uint64_t& sum) const {
+        counts.resize(buckets);
+        for (size_t i = 0; i < buckets; ++i) counts[i] += counts_[i].get();
+        sum += sum_.get();
+    }
+
+private:
+    array<Counter, buckets> counts_;
+    Counter sum_;
+};
+
+struct ThreadMetrics {
+    Counter accepts;
+    Counter disconnects;
+    Counter frames_in;
+    Counter throttled;              // times a session's reads were paused
+    Counter bytes_written;
+    Counter deflate_in;             // bytes of frames deflated, and what they came to
+    Counter deflate_out;
+    Gauge queued_frames;            // outbound frames queued or in flight
+    Gauge queued_bytes;
+    Histogram fanout_recipients;
+    Histogram read_to_deliver_us;   // inbound read to recipient write completion
+};
+
+mutex metrics_mutex;
+vector<ThreadMetrics*> all_metrics;   // never shrinks; io threads live for the process
+
+ThreadMetrics& metrics() {
+    thread_local ThreadMetrics* m = [] {
+        auto* tm = new ThreadMetrics();
+        lock_guard<mutex> lock(metrics_mutex);
+        all_metrics.push_back(tm);
+        return tm;
+    }();
+    return *m;
+}
+
+// ======= Tracing =======
+// With --trace-sample N, one inbound line in N is followed through its
+// stages: waiting in the receive buffer after the read, its handler, the
+// fan-out on the room's shard, and the write to each recipient. Each thread
+// records its spans into its own ring of trace_ring_size events, the oldest
+// overwritten first; GET /trace on the admin port dumps the rings in the
+// Chrome trace event format (chrome://tracing, ui.perfetto.dev), with one
+// flow per traced line.
+enum class TraceStage : uint8_t { Read, Dispatch, FanOut, Write };
+constexpr const char* trace_stage_names[] = {"read", "dispatch", "fan-out", "write"};
+constexpr size_t trace_ring_size = 1 << 14;
+const Clock::time_point trace_epoch = Clock::now();
+atomic<uint32_t> next_trace{1};
+
+struct TraceEvent {
+    uint32_t trace;
+    TraceStage stage;
+    int64_t thread;
+    int64_t start_ns;
+    int64_t dur_ns;
+};
+
+// One writer, its own thread, and any number of readers without a lock: a
+// slot's sequence number is odd while it is being written, and a reader
+// keeps what it copied only if the number was even and didn't change.
+class TraceRing {
+public:
+    explicit TraceRing(int64_t thread) : thread_(thread), slots_(trace_ring_size) {}
+
+    void record(uint32_t trace, TraceStage stage, Clock::time_point start, Clock::time_point end) {
+        Slot& s = slots_[head_ % trace_ring_size];
+        uint64_t seq = head_++ * 2 + 1;
+        s.seq.store(seq, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        s.trace.store(trace, memory_order_relaxed);
+        s.stage.store(stage, memory_order_relaxed);
+        s.start_ns.store(chrono::duration_cast<chrono::nanoseconds>(start - trace_epoch).count(),
+                         memory_order_relaxed);
+        s.dur_ns.store(chrono::duration_cast<chrono::nanoseconds>(end - start).count(), memory_order_relaxed);
+        s.seq.store(seq + 1, memory_order_release);
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (auto& s : slots_) {
+            uint64_t seq = s.seq.load(memory_order_acquire);
+            if (seq == 0 || (seq & 1)) continue;
+            TraceEvent e{s.trace.load(memory_order_relaxed), s.stage.load(memory_order_relaxed), thread_,
+                         s.start_ns.load(memory_order_relaxed), s.dur_ns.load(memory_order_relaxed)};
+            atomic_thread_fence(memory_order_acquire);
+            if (s.seq.load(memory_order_relaxed) == seq) f(e);
+        }
+    }
+
+private:
+    struct Slot {
+        atomic<uint64_t> seq{0};
+        atomic<uint32_t> trace{0};
+        atomic<TraceStage> stage{TraceStage::Read};
+        atomic<int64_t> start_ns{0};
+        atomic<int64_t> dur_ns{0};
+    };
+
+    const int64_t thread_;   // io context index, -1 off the pool
+    vector<Slot> slots_;
+    uint64_t head_ = 0;
+};
+
+mutex trace_mutex;
+vector<TraceRing*> all_traces;   // like all_metrics, never shrinks
+
+void trace_span(uint32_t trace, TraceStage stage, Clock::time_point start, Clock::time_point end) {
+    if (!trace) return;
+    thread_local TraceRing* ring = [] {
+        auto* r = new TraceRing(this_shard == SIZE_MAX ? -1 : int64_t(this_shard));
+        lock_guard<mutex> lock(trace_mutex);
+        all_traces.push_back(r);
+        return r;
+    }();
+    ring->record(trace, stage, start, end);
+}
+
+uint32_t sample_trace() {
+    if (!config.trace_sample) return 0;
+    thread_local uint64_t lines = 0;
+    if (++lines % config.trace_sample) return 0;
+    uint32_t id = next_trace++;
+    return id ? id : next_trace++;
+}
+
+// Around one inbound line's handler: frames built meanwhile carry its
+// trace, if it was sampled.
+struct TraceScope {
+    TraceScope() : trace(sample_trace()) {
+        if (trace) start = Clock::now();
+        dispatch_trace = trace;
+    }
+
+    ~TraceScope() {
+        dispatch_trace = 0;
+        if (!trace) return;
+        trace_span(trace, TraceStage::Read, dispatch_origin, start);
+        trace_span(trace, TraceStage::Dispatch, start, Clock::now());
+    }
+
+    uint32_t trace;
+    Clock::time_point start;
+};
+
+// ======= Compression =======
+// A client may ask for deflated output by sending deflate_magic before
+// anything else (before binary_magic, if it speaks that too). The server
+// answers deflate_magic | dictionary length (2, big-endian) | dictionary,
+// or "\0CZ\0" if it won't compress. Everything it sends after that is
+// deflate records:
+//   length (4, big-endian) | raw deflate data (RFC 1951)
+// one per outbound frame. Each record is compressed on its own against the
+// preset dictionary, with no history carried over from the last, so a
+// room message is deflated once per rendering and every member who asked
+// gets the same record, instead of once per connection.
+constexpr string_view deflate_magic("\0CZ\1", 4);
+constexpr string_view deflate_refused("\0CZ\0", 4);
+
+// Stock phrases, the likeliest last: deflate matches the end best.
+constexpr string_view deflate_dictionary(
+    "Presence: joined ; left  more). Type to chat here.\nYou are now in room You have new message in pv "
+    " left room . joined room . (PV): \033[34m\033[35m\033[33m\033[32m\033[36m\033[0m [");
+
+#ifdef CHAT_WITH_ZLIB
+constexpr bool deflate_available = true;
+
+Frame deflate_frame(const Frame& frame) {
+    struct Deflater {
+        Deflater() { deflateInit2(&z, config.deflate_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); }
+        ~Deflater() { deflateEnd(&z); }
+        z_stream z{};
+    };
+    thread_local Deflater d;
+    FrameString in;
+    frame->append_to(in);
+    deflateReset(&d.z);
+    deflateSetDictionary(&d.z, reinterpret_cast<const Bytef*>(deflate_dictionary.data()),
+                         uInt(deflate_dictionary.size()));
+    FrameString out(4 + deflateBound(&d.z, uLong(in.size())), '\0');
+    d.z.next_in = reinterpret_cast<Bytef*>(in.data());
+    d.z.avail_in = uInt(in.size());
+    d.z.next_out = reinterpret_cast<Bytef*>(out.data() + 4);
+    d.z.avail_out = uInt(out.size() - 4);
+    deflate(&d.z, Z_FINISH);
+    size_t n = out.size() - 4 - d.z.avail_out;
+    out.resize(4 + n);
+    put_u32(out.data(), uint32_t(n));
+    metrics().deflate_in.add(in.size());
+    metrics().deflate_out.add(out.size());
+    return allocate_shared<const FrameData>(PoolAllocator<FrameData>(),
+                                            FrameData{std::move(out), nullptr, {}, nullptr, {}, frame->origin,
+                                                      frame->trace, true});
+}
+#else
+constexpr bool deflate_available = false;
+
+Frame deflate_frame(const Frame& frame) { return frame; }
+#endif
+
+// ======= Rate limits =======
+// A token bucket of `burst` tokens refilled at `rate` per second, kept as a
+// single theoretical arrival time (the GCRA form) so that a room's bucket
+// can be shared lock-free by senders on every io thread.
+class RateLimiter {
+public:
+    RateLimiter(double rate, double burst)
+        : interval_(rate > 0 ? int64_t(1e9 / rate) : 0),
+          tolerance_(int64_t(double(interval_) * (burst - 1))) {}
+
+    // Takes a token; if none is left, takes nothing and says how long until
+    // one will be.
+    Clock::duration acquire(Clock::time_point now) {
+        if (!interval_) return {};
+        int64_t t = chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+        int64_t tat = tat_.load(memory_order_relaxed);
+        while (true) {
+            if (t < tat - tolerance_) return chrono::nanoseconds(tat - tolerance_ - t);
+            if (tat_.compare_exchange_weak(tat, max(tat, t) + interval_, memory_order_relaxed)) return {};
+        }
+    }
+
+    // Gives back a token taken by acquire().
+    void refund() {
+        if (interval_) tat_.fetch_sub(interval_, memory_order_relaxed);
+    }
+
+private:
+    const int64_t interval_;    // ns per token
+    const int64_t tolerance_;   // how far ahead of now the bucket may run
+    atomic<int64_t> tat_{0};
+};
+
+// ======= Input framing =======
+using RecvBuffer = vector<char, PoolAllocator<char>>;
+
+// Splits the inbound byte stream into '\n'-terminated lines, or into binary
+// packets for binary-protocol sessions. Reads go straight into a ref-counted
+// receive buffer that outbound frames may borrow chat text from. Consumed
+// input is compacted away before the next read, and the buffer is reused
+// for the whole session unless a queued frame still references it; then
+// the unconsumed tail moves to a fresh buffer instead. A single read may
+// yield several frames, and a frame may span several reads.
+class InputFramer {
+public:
+    explicit InputFramer(size_t max_line)
+        : max_line_(max_line), buf_(new_buffer()) {}
+
+    // Free space at the tail of the buffer for the next read. Bytes already
+    // handed out are never overwritten while the buffer is shared.
+    asio::mutable_buffer prepare() {
+        bool shared = buf_.use_count() > 1;
+        if (start_ == end_) {
+            if (shared) buf_ = new_buffer();
+            start_ = end_ = scan_ = 0;
+        } else if (start_ > 0 && buf_->size() - end_ < buf_->size() / 2) {
+            if (shared) {
+                auto fresh = new_buffer();
+                memcpy(fresh->data(), buf_->data() + start_, end_ - start_);
+                buf_ = std::move(fresh);
+            } else {
+                memmove(buf_->data(), buf_->data() + start_, end_ - start_);
+            }
+            end_ -= start_;
+            scan_ -= start_;
+            start_ = 0;
+        }
+        return asio::buffer(buf_->data() + end_, buf_->size() - end_);
+    }
+
+    // A view handed out by next_line/next_packet, for frames to forward.
+    // Unless it fills a good part of the buffer, it is copied out: a queued
+    // frame would otherwise keep all of the buffer alive.
+    BodyRef borrow(string_view bytes) const {
+        if (bytes.size() * 4 < buf_->size()) {
+            auto copy = make_shared_string({bytes});
+            return {string_view(copy->data(), copy->size()), copy, 0};
+        }
+        return {bytes, buf_, buf_->size() - bytes.size()};
+    }
+
+    void commit(size_t n) { end_ += n; }
+
+    // Input carried over by a handoff, taken in as if it had been read.
+    void preload(string_view bytes) {
+        auto space = prepare();
+        size_t n = min(bytes.size(), space.size());
+        if (n) memcpy(space.data(), bytes.data(), n);
+        commit(n);
+    }
+
+    // Hands out the next complete line (without its '\n'). Returns false once
+    // only a partial line is left. A line longer than max_line is dropped in
+    // full and counted in overflows().
+    bool next_line(string_view& line) {
+        while (true) {
+            const char* base = buf_->data();
+            const void* nl = memchr(base + scan_, '\n', end_ - scan_);
+            if (!nl) {
+                scan_ = end_;
+                if (end_ - start_ > max_line_) {
+                    if (!discarding_) ++overflows_;
+                    discarding_ = true;
+                    start_ = scan_ = end_;
+                }
+                return false;
+            }
+            size_t pos = static_cast<const char*>(nl) - base;
+            size_t begin = start_;
+            start_ = scan_ = pos + 1;
+            if (discarding_) {
+                discarding_ = false;
+                continue;
+            }
+            if (pos - begin > max_line_) {
+                ++overflows_;
+                continue;
+            }
+            line = string_view(base + begin, pos - begin);
+            return true;
+        }
+    }
+
+    size_t take_overflows() { return exchange(overflows_, 0); }
+
+    // Puts back the line or packet payload last handed out, to be handed out
+    // again by the next call.
+    void unread(string_view line) { start_ = scan_ = size_t(line.data() - buf_->data()); }
+    void unread_packet(string_view payload) { unread(string_view(payload.data() - packet_header_size, 0)); }
+
+    // Unconsumed input, used to sniff the protocol before any framing.
+    string_view pending() const { return string_view(buf_->data() + start_, end_ - start_); }
+
+    void consume(size_t n) { start_ = scan_ = start_ + n; }
+
+    enum class PacketStatus { Ready, Incomplete, TooLarge };
+
+    // Hands out the next complete binary packet. Payloads over max_line are
+    // a protocol error: there is no way to resync on a binary stream.
+    PacketStatus next_packet(PacketHeader& header, string_view& payload) {
+        if (end_ - start_ < packet_header_size) return PacketStatus::Incomplete;
+        const char* p = buf_->data() + start_;
+        header.op = Op(uint8_t(p[0]));
+        header.flags = uint8_t(p[1]);
+        header.id = get_u32(p + 2);
+        header.length = get_u32(p + 6);
+        if (header.length > max_line_) return PacketStatus::TooLarge;
+        if (end_ - start_ < packet_header_size + header.length) return PacketStatus::Incomplete;
+        payload = string_view(p + packet_header_size, header.length);
+        consume(packet_header_size + header.length);
+        return PacketStatus::Ready;
+    }
+
+private:
+    shared_ptr<RecvBuffer> new_buffer() const {
+        return allocate_shared<RecvBuffer>(PoolAllocator<RecvBuffer>(),
+                                           max(max_line_ + packet_header_size + 1, size_t(4096)));
+    }
+
+    size_t max_line_;
+    shared_ptr<RecvBuffer> buf_;
+    size_t start_ = 0;        // first unconsumed byte
+    size_t end_ = 0;          // end of received data
+    size_t scan_ = 0;         // where the next '\n' search resumes
+    bool discarding_ = false; // inside an overlong line, skipping to its '\n'
+    size_t overflows_ = 0;
+};
+
+// ======= Listings =======
+// A sorted index of names behind /rooms and /users, updated as users and
+// rooms come and go, so a listing reads one page instead of sorting
+// everything. Rendered pages are cached until the next change. Names are
+// views into a SymbolTable, which never moves them.
+class Listing {
+public:
+    void insert(string_view name) {
+        unique_lock<shared_mutex> lock(m_);
+        names_.insert(name);
+        ++version_;
+    }
+
+    void erase(string_view name) {
+        unique_lock<shared_mutex> lock(m_);
+        names_.erase(name);
+        ++version_;
+    }
+
+    // Something a rendered page shows changed (e.g. a room's member count).
+    void touch() { ++version_; }
+
+    // Up to size names starting with prefix that sort after `after` (from
+    // the first if empty); more is set if another page follows. Paging
+    // resumes from the last name shown, so any page costs O(log n + size).
+    vector<string_view> page(string_view prefix, string_view after, size_t size, bool& more) const {
+        shared_lock<shared_mutex> lock(m_);
+        auto it = after > prefix ? names_.upper_bound(after) : names_.lower_bound(prefix);
+        auto matches = [&] { return it != names_.end() && it->substr(0, prefix.size()) == prefix; };
+        vector<string_view> out;
+        for (; out.size() < size && matches(); ++it) out.push_back(*it);
+        more = matches();
+        return out;
+    }
+
+    template <typename Render>
+    Message cached(const string& key, Render&& render) {
+        uint64_t version = version_;
+        {
+            lock_guard<mutex> lock(cache_m_);
+            auto it = cache_.find(key);
+            if (it != cache_.end() && it->second.first == version) return it->second.second;
+        }
+        Message msg = render();
+        lock_guard<mutex> lock(cache_m_);
+        if (cache_.size() >= 64) cache_.clear();
+        cache_[key] = {version, msg};
+        return msg;
+    }
+
+private:
+    mutable shared_mutex m_;
+    set<string_view> names_;
+    atomic<uint64_t> version_{0};
+    mutex cache_m_;
+    unordered_map<string, pair<uint64_t, Message>> cache_;
+};
+
+Listing user_listing;
+Listing room_listing;
+
+// ======= Message log =======
+// With --log-dir, every room's chat is appended to a log of fixed-size,
+// memory-mapped segment files (<room>-<n>.seg). Each segment starts with a
+// 16-byte header (magic, first sequence number) followed by records:
+//   text length (4) | binary length (4) | text rendering | RoomMsg payload
+// A zero length pair marks the end; new files are zero-filled.
+//
+// The io threads only hand messages (shared frames, no copy) to one writer
+// thread. Every log_commit_ms it copies whatever has queued up into the
+// mappings, msyncs once per room (group commit) and only then publishes the
+// records to readers.
+// Replay on /join hands out frames that point straight into the mapping, so
+// history is written from the page cache without being copied into a buffer.
+// A segment keeps no descriptor open once mapped. A room whose files can't
+// be made or mapped, or that would take the logs past --log-max-maps, runs
+// without history instead.
+// Until the writer has committed a message, the room's shard keeps it in a
+// tail (Room::log_tail). A join replays the log up to the last commit and
+// then that tail, so history and live chat meet without a gap.
+#ifndef _WIN32
+struct LogSegment {
+    static constexpr size_t header_size = 16;
+    static constexpr uint64_t index_every = 32;
+
+    LogSegment(string file, size_t bytes, uint64_t first, bool create) : path(std::move(file)) {
+        int fd = ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+        if (fd < 0) throw runtime_error("cannot open " + path + ": " + strerror(errno));
+        auto fail = [&](const char* what) {
+            string error = what + path + ": " + strerror(errno);
+            ::close(fd);
+            if (create) unlink(path.c_str());
+            return runtime_error(error);
+        };
+        if (create && ftruncate(fd, off_t(bytes)) != 0) throw fail("cannot size ");
+        struct stat st;
+        if (fstat(fd, &st) != 0) throw fail("cannot stat ");
+        size = size_t(st.st_size);
+        errno = EINVAL;
+        void* p = size >= header_size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (p == MAP_FAILED) throw fail("cannot map ");
+        ::close(fd);
+        base = static_cast<char*>(p);
+        if (create) {
+            memcpy(base, "CHATLOG1", 8);
+            put_u32(base + 8, uint32_t(first >> 32));
+            put_u32(base + 12, uint32_t(first));
+            first_seq = first;
+        } else {
+            if (memcmp(base, "CHATLOG1", 8) != 0) {
+                munmap(base, size);
+                throw runtime_error("not a message log segment: " + path);
+            }
+            first_seq = (uint64_t(get_u32(base + 8)) << 32) | get_u32(base + 12);
+            recover();
+        }
+    }
+
+    ~LogSegment() { munmap(base, size); }
+
+    // Record at off, or false at the end of the segment.
+    bool record_at(size_t off, string_view& text, string_view& binary) const {
+        if (off + 8 > size) return false;
+        uint32_t t = get_u32(base + off), b = get_u32(base + off + 4);
+        if ((t == 0 && b == 0) || off + 8 + t + b > size) return false;
+        text = string_view(base + off + 8, t);
+        binary = string_view(base + off + 8 + t, b);
+        return true;
+    }
+
+    // Finds the end of a segment left by an earlier run.
+    void recover() {
+        string_view t, b;
+        while (record_at(write_end, t, b)) {
+            if (write_count % index_every == 0) index.emplace_back(first_seq + write_count, uint32_t(write_end));
+            write_end += 8 + t.size() + b.size();
+            ++write_count;
+        }
+        end = write_end;
+        count = write_count;
+    }
+
+    string path;
+    char* base = nullptr;
+    size_t size = 0;
+    uint64_t first_seq = 0;
+
+    // published to readers; guarded by RoomLog::m
+    size_t end = header_size;
+    uint64_t count = 0;
+    vector<pair<uint64_t, uint32_t>> index;    // sparse (seq, offset)
+
+    // writer thread only
+    size_t write_end = header_size;
+    uint64_t write_count = 0;
+    size_t synced = header_size;
+    vector<pair<uint64_t, uint32_t>> new_index;
+};
+
+struct RoomLog {
+    RoomLog(string file_prefix, RoomId room_id) : prefix(std::move(file_prefix)), id(room_id) {}
+
+    const string prefix;
+    const RoomId id;
+    mutex m;
+    deque<shared_ptr<LogSegment>> segments;   // modified by the writer under m; empty until the first message
+    uint32_t next_number = 0;                 // writer only
+    bool dirty = false;                       // writer only
+    atomic<bool> failed{false};               // the writer couldn't make a segment; no longer recorded
+    atomic<uint64_t> committed{0};            // sequence number after the last committed message
+    uint64_t next_seq = 0;                    // room's shard only; the next appended message's
+};
+
+class MessageLog {
+public:
+    explicit MessageLog(string dir) : dir_(std::move(dir)) {
+        filesystem::create_directories(dir_);
+        recover();
+        writer_ = thread([this] { run(); });
+    }
+
+    ~MessageLog() {
+        {
+            lock_guard<mutex> lock(m_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        writer_.join();
+    }
+
+    // Opens a room's log with the segments recover() left for it; the first
+    // new segment is made with the room's first message. Null if the room
+    // has to go without one. Touches no files: this runs on an io thread.
+    shared_ptr<RoomLog> open(string_view room, RoomId id) {
+        string name = file_name(room);
+        OnDisk disk;
+        {
+            lock_guard<mutex> lock(m_);
+            auto it = on_disk_.find(name);
+            if (it != on_disk_.end()) {
+                disk = std::move(it->second);
+                on_disk_.erase(it);
+            }
+            if (disk.segments.empty()) {   // recover() has reserved for those with segments
+                if (reserved_maps_ + config.log_segments > config.log_max_maps) {
+                    if (!maps_warned_) cerr << "--log-max-maps reached; new rooms run without history\n";
+                    maps_warned_ = true;
+                    return nullptr;
+                }
+                reserved_maps_ += config.log_segments;
+            }
+        }
+        auto log = make_shared<RoomLog>(dir_ + "/" + name + "-", id);
+        log->next_number = disk.next_number;
+        log->segments = std::move(disk.segments);
+        if (!log->segments.empty()) {
+            auto& back = *log->segments.back();
+            log->committed = log->next_seq = back.first_seq + back.count;
+        }
+        return log;
+    }
+
+    // Called on the room's shard, in fan-out order. False if msg won't be
+    // recorded; otherwise it gets the sequence number log->next_seq++.
+    bool append(const shared_ptr<RoomLog>& log, const Message& msg) {
+        if (!msg.text || !msg.binary || log->failed) return false;
+        if (record_size(*msg.text, *msg.binary) + LogSegment::header_size > config.log_segment_bytes) return false;
+        ++log->next_seq;
+        lock_guard<mutex> lock(m_);
+        pending_.push_back({log, msg});
+        if (pending_.size() == 1) cv_.notify_one();
+        return true;
+    }
+
+    // Up to n of the room's committed messages before sequence number upto,
+    // oldest first.
+    template <typename F>
+    void replay(RoomLog& log, size_t n, uint64_t upto, F&& f) {
+        struct Item {
+            shared_ptr<LogSegment> seg;
+            string_view text, binary;
+        };
+        vector<Item> items;
+        {
+            lock_guard<mutex> lock(log.m);
+            if (log.segments.empty()) return;
+            auto& back = *log.segments.back();
+            upto = min(upto, back.first_seq + back.count);
+            uint64_t first = log.segments.front()->first_seq;
+            if (upto <= first) return;
+            uint64_t start = upto - min<uint64_t>(n, upto - first);
+            for (auto& seg : log.segments) {
+                if (seg->first_seq + seg->count <= start) continue;
+                auto it = upper_bound(seg->index.begin(), seg->index.end(), make_pair(start, UINT32_MAX));
+                uint64_t seq = seg->first_seq;
+                size_t off = LogSegment::header_size;
+                if (it != seg->index.begin()) {
+                    seq = prev(it)->first;
+                    off = prev(it)->second;
+                }
+                string_view t, b;
+                uint64_t end = min(seg->first_seq + seg->count, upto);
+                for (; seq < end && seg->record_at(off, t, b); ++seq) {
+                    if (seq >= start) items.push_back({seg, t, b});
+                    off += 8 + t.size() + b.size();
+                }
+            }
+        }
+        for (auto& item : items) {
+            Message m;
+            m.text = make_forward({}, nullptr, {item.text, item.seg}, {});
+            m.binary = make_forward_packet(Op::RoomMsg, log.id, nullptr, {item.binary, item.seg});
+            f(m);
+        }
+    }
+
+private:
+    struct Pending {
+        shared_ptr<RoomLog> log;
+        Message msg;
+    };
+
+    // Segments of earlier runs for a room nobody has opened yet.
+    struct OnDisk {
+        uint32_t next_number = 0;
+        deque<shared_ptr<LogSegment>> segments;
+    };
+
+    // Scans the directory once, at startup: maps the newest log_segments
+    // segments of every room and deletes older ones, which are past the
+    // retention a running writer keeps.
+    void recover() {
+        map<string, vector<pair<uint32_t, string>>> files;   // by room file name
+        for (auto& entry : filesystem::directory_iterator(dir_)) {
+            string file = entry.path().filename().string();
+            size_t dash = file.size() >= 13 ? file.size() - 13 : string::npos;
+            if (dash == string::npos || file[dash] != '-' || file.compare(file.size() - 4, 4, ".seg") != 0 ||
+                file.find_first_not_of("0123456789", dash + 1) != file.size() - 4) {
+                continue;
+            }
+            files[file.substr(0, dash)].emplace_back(uint32_t(stoul(file.substr(dash + 1, 8))), entry.path().string());
+        }
+        for (auto& [name, segs] : files) {
+            sort(segs.begin(), segs.end());
+            OnDisk& disk = on_disk_[name];
+            disk.next_number = segs.back().first + 1;
+            size_t old = segs.size() > config.log_segments ? segs.size() - config.log_segments : 0;
+            for (size_t i = 0; i < old; ++i) unlink(segs[i].second.c_str());
+            if (reserved_maps_ + config.log_segments > config.log_max_maps) {
+                cerr << "--log-max-maps reached; no history for room file " << name << "\n";
+                continue;
+            }
+            try {
+                for (size_t i = old; i < segs.size(); ++i) {
+                    disk.segments.push_back(make_shared<LogSegment>(segs[i].second, 0, 0, false));
+                }
+                reserved_maps_ += config.log_segments;
+            } catch (const exception& e) {
+                cerr << "No history for room file " << name << ": " << e.what() << "\n";
+                disk.segments.clear();
+            }
+        }
+    }
+
+    // Room names become file names: [A-Za-z0-9_-] as is, anything else %XX.
+    static string file_name(string_view room) {
+        static const char hex[] = "0123456789ABCDEF";
+        string out;
+        for (unsigned char c : room) {
+            if (isalnum(c) || c == '_' || c == '-') {
+                out += char(c);
+            } else {
+                out += '%';
+                out += hex[c >> 4];
+                out += hex[c & 15];
+            }
+        }
+        return out;
+    }
+
+    // Drops the oldest segment first, so a room never maps more than its
+    // reserved log_segments (readers may hold on to a dropped one a while).
+    void add_segment(RoomLog& log, uint64_t first_seq) {
+        {
+            lock_guard<mutex> lock(log.m);
+            while (log.segments.size() >= config.log_segments) {
+                unlink(log.segments.front()->path.c_str());   // mappings stay valid for readers
+                log.segments.pop_front();
+            }
+        }
+        char number[16];
+        snprintf(number, sizeof(number), "%08u", log.next_number++);
+        auto seg = make_shared<LogSegment>(log.prefix + number + ".seg", config.log_segment_bytes, first_seq, true);
+        lock_guard<mutex> lock(log.m);
+        log.segments.push_back(std::move(seg));
+    }
+
+    void run() {
+        vector<Pending> batch;
+        vector<RoomLog*> touched;
+        while (true) {
+            {
+                unique_lock<mutex> lock(m_);
+                cv_.wait(lock, [&] { return stopping_ || !pending_.empty(); });
+                if (!stopping_) {
+                    // let the batch fill up; the io threads never wait on this
+                    cv_.wait_for(lock, chrono::milliseconds(config.log_commit_ms), [&] { return stopping_; });
+                }
+                if (pending_.empty()) return;
+                batch.swap(pending_);
+            }
+            for (auto& p : batch) {
+                if (!p.log->dirty) {
+                    p.log->dirty = true;
+                    touched.push_back(p.log.get());
+                }
+                write(*p.log, *p.msg.text, *p.msg.binary);
+            }
+            for (auto* log : touched) {
+                commit(*log);
+                log->dirty = false;
+            }
+            touched.clear();
+            batch.clear();
+        }
+    }
+
+    // The binary rendering is stored without its packet header.
+    static size_t record_size(const FrameData& text, const FrameData& binary) {
+        return 8 + text.size() + binary.size() - packet_header_size;
+    }
+
+    // append() has checked the record fits in a segment.
+    void write(RoomLog& log, const FrameData& text, const FrameData& binary) {
+        size_t t = text.size(), b = binary.size() - packet_header_size;
+        size_t need = record_size(text, binary);
+        if (log.failed) return;
+        LogSegment* seg = log.segments.empty() ? nullptr : log.segments.back().get();
+        if (!seg || seg->write_end + need > seg->size) {
+            uint64_t first_seq = seg ? seg->first_seq + seg->write_count : 0;
+            if (seg) commit(log);
+            try {
+                add_segment(log, first_seq);
+            } catch (const exception& e) {
+                cerr << "Stopped logging " << log.prefix << "*: " << e.what() << "\n";
+                log.failed = true;
+                return;
+            }
+            seg = log.segments.back().get();
+        }
+        char* p = seg->base + seg->write_end;
+        put_u32(p, uint32_t(t));
+        put_u32(p + 4, uint32_t(b));
+        binary.copy_to(text.copy_to(p + 8), packet_header_size);
+        if (seg->write_count % LogSegment::index_every == 0) {
+            seg->new_index.emplace_back(seg->first_seq + seg->write_count, uint32_t(seg->write_end));
+        }
+        seg->write_end += need;
+        ++seg->write_count;
+    }
+
+    // Flushes the newest segment's new records to disk, then publishes them.
+    void commit(RoomLog& log) {
+        if (log.segments.empty()) return;
+        LogSegment& seg = *log.segments.back();
+        if (seg.write_end == seg.synced) return;
+        static const size_t page = size_t(sysconf(_SC_PAGESIZE));
+        size_t from = seg.synced / page * page;
+        msync(seg.base + from, seg.write_end - from, MS_SYNC);
+        seg.synced = seg.write_end;
+        lock_guard<mutex> lock(log.m);
+        seg.end = seg.write_end;
+        seg.count = seg.write_count;
+        seg.index.insert(seg.index.end(), seg.new_index.begin(), seg.new_index.end());
+        seg.new_index.clear();
+        log.committed = seg.first_seq + seg.count;
+    }
+
+    string dir_;
+    mutex m_;
+    condition_variable cv_;
+    vector<Pending> pending_;
+    bool stopping_ = false;
+    size_t reserved_maps_ = 0;   // log_segments per open room log
+    bool maps_warned_ = false;
+    unordered_map<string, OnDisk> on_disk_;
+    thread writer_;
+};
+#else
+// The message log needs mmap; main refuses --log-dir on Windows.
+struct RoomLog {
+    atomic<bool> failed{false};
+    atomic<uint64_t> committed{0};
+};
+
+class MessageLog {
+public:
+    explicit MessageLog(string) {}
+    shared_ptr<RoomLog> open(string_view, RoomId) { return nullptr; }
+    bool append(const shared_ptr<RoomLog>&, const Message&) { return false; }
+    template <typename F>
+    void replay(RoomLog&, size_t, uint64_t, F&&) {}
+};
+#endif
+
+unique_ptr<MessageLog> message_log;
+
+// ======= Cluster =======
+// In cluster mode several servers share one chat. Nodes form a full mesh
+// with one persistent link per pair: the node with the smaller --cluster
+// address dials (and redials) and the other accepts. Over a link, nodes say
+// which rooms have local members and which users are signed in locally.
+// A room message is then forwarded once to each node with members in that
+// room, however many members the node has, and a PV message goes to the
+// node its target is on. Links queue frames and write whatever has queued
+// during the previous write as one batch.
+//
+// Link packets use the binary-protocol header with the node ops below;
+// strings in payloads are a u8 length followed by the bytes.
+void put_str(FrameString& out, string_view s) {
+    s = s.substr(0, 255);
+    out += char(s.size());
+    out.append(s.data(), s.size());
+}
+
+bool take_str(string_view& in, string_view& s) {
+    if (in.empty() || in.size() < 1 + size_t(uint8_t(in[0]))) return false;
+    s = in.substr(1, uint8_t(in[0]));
+    in.remove_prefix(1 + s.size());
+    return true;
+}
+
+Frame make_node_packet(Op op, uint8_t flags, string_view a) {
+    FrameString payload;
+    put_str(payload, a);
+    char head[packet_header_size];
+    head[0] = char(op);
+    head[1] = char(flags);
+    put_u32(head + 2, 0);
+    put_u32(head + 6, uint32_t(payload.size()));
+    return make_frame(string_view(head, sizeof(head)), {payload});
+}
+
+// A forward whose payload is str(first) + sender (already u8-prefixed) + body.
+Frame make_node_forward(Op op, string_view first, SharedString sender, BodyRef body) {
+    first = first.substr(0, 255);
+    char head[packet_header_size + 256];
+    head[0] = char(op);
+    head[1] = 0;
+    put_u32(head + 2, 0);
+    put_u32(head + 6, uint32_t(1 + first.size() + sender->size() + body.bytes.size()));
+    head[packet_header_size] = char(first.size());
+    if (!first.empty()) memcpy(head + packet_header_size + 1, first.data(), first.size());
+    return make_forward(string_view(head, packet_header_size + 1 + first.size()), std::move(sender),
+                        std::move(body), {});
+}
+
+// Remote users have no session to hold a color, so theirs follows the name.
+const string& remote_color(string_view name) {
+    return name_colors[hash<string_view>()(name) % name_colors.size()];
+}
+
+class ClusterLink : public enable_shared_from_this<ClusterLink> {
+public:
+    static constexpr size_t max_queued_bytes = 64 << 20;
+
+    ClusterLink(asio::io_context& io, tcp::socket socket, string peer, bool dialed)
+        : executor_(io.get_executor()), socket_(std::move(socket)), framer_(config.max_line + 1024),
+          peer_(std::move(peer)), dialed_(dialed) {}
+
+    void start();
+
+    // Safe to call from any io thread.
+    void send(Frame frame) {
+        if (executor_.running_in_this_thread()) {
+            enqueue(std::move(frame));
+        } else {
+            asio::post(executor_, [self = shared_from_this(), frame = std::move(frame)]() mutable {
+                self->enqueue(std::move(frame));
+            });
+        }
+    }
+
+    const string& peer() const { return peer_; }
+    void set_peer(string_view peer) { peer_ = peer; }   // link thread only
+    bool dialed() const { return dialed_; }
+
+    FlatMap<char> rooms;    // rooms the peer has members in; link thread only
+
+private:
+    void enqueue(Frame frame) {
+        if (closed_) return;
+        if (queued_bytes_ + frame->footprint() > max_queued_bytes) {
+            backpressure_stats.dropped_bytes += frame->size();
+            return;
+        }
+        queued_bytes_ += frame->footprint();
+        outbox_.push_back(std::move(frame));
+        if (!writing_) do_write();
+    }
+
+    void do_write() {
+        writing_ = true;
+        inflight_.swap(outbox_);
+        queued_bytes_ = 0;
+        write_bufs_.clear();
+        for (auto& f : inflight_) f->gather(write_bufs_);
+        asio::async_write(socket_, write_bufs_,
+            [this, self = shared_from_this()](std::error_code ec, size_t written) {
+                metrics().bytes_written.add(written);
+                inflight_.clear();
+                writing_ = false;
+                if (ec) {
+                    close();
+                } else if (!outbox_.empty()) {
+                    do_write();
+                }
+            });
+    }
+
+    void do_read() {
+        socket_.async_read_some(framer_.prepare(),
+            [this, self = shared_from_this()](std::error_code ec, size_t length) {
+                if (ec) {
+                    close();
+                    return;
+                }
+                framer_.commit(length);
+                DispatchScope scope(Clock::now());
+                PacketHeader header;
+                string_view payload;
+                InputFramer::PacketStatus status;
+                while ((status = framer_.next_packet(header, payload)) == InputFramer::PacketStatus::Ready) {
+                    on_packet(header, payload);
+                }
+                if (status == InputFramer::PacketStatus::TooLarge) {
+                    close();
+                    return;
+                }
+                do_read();
+            });
+    }
+
+    void on_packet(const PacketHeader& header, string_view payload);
+    void close();
+
+    asio::io_context::executor_type executor_;
+    tcp::socket socket_;
+    InputFramer framer_;
+    string peer_;
+    bool dialed_;
+    vector<Frame> outbox_;
+    vector<Frame> inflight_;
+    vector<asio::const_buffer> write_bufs_;
+    size_t queued_bytes_ = 0;
+    bool writing_ = false;
+    bool closed_ = false;
+};
+
+class Cluster {
+public:
+    Cluster(string self, vector<string> peers) : self_(std::move(self)), peers_(std::move(peers)) {}
+
+    void start();
+
+    bool has_user(SymbolId id) {
+        lock_guard<mutex> lock(m_);
+        return remote_users_.find(id) != nullptr;
+    }
+
+    void user_online(string_view name) { broadcast(make_node_packet(Op::NodeUser, 1, name)); }
+    void user_offline(string_view name) { broadcast(make_node_packet(Op::NodeUser, 0, name)); }
+
+    // A room got its first local member, or lost its last one.
+    void set_interest(string_view room, bool on) { broadcast(make_node_packet(Op::NodeRoom, on, room)); }
+
+    // Sends a PV to the node the target is on; false if no node has them.
+    bool forward_pv(SymbolId target, SharedString sender, const BodyRef& text) {
+        shared_ptr<ClusterLink> link;
+        {
+            lock_guard<mutex> lock(m_);
+            if (auto* l = remote_users_.find(target)) link = *l;
+        }
+        if (!link) return false;
+        link->send(make_node_forward(Op::NodePv, user_names.name(target), std::move(sender), text));
+        return true;
+    }
+
+    void link_up(const shared_ptr<ClusterLink>& link);
+    void link_down(const shared_ptr<ClusterLink>& link);
+    void handle(const shared_ptr<ClusterLink>& link, const PacketHeader& header, string_view payload);
+
+private:
+    void broadcast(const Frame& frame) {
+        vector<shared_ptr<ClusterLink>> links;
+        {
+            lock_guard<mutex> lock(m_);
+            links = links_;
+        }
+        for (auto& l : links) l->send(frame);
+    }
+
+    void accept();
+    void dial(const string& peer);
+    void redial(const string& peer);
+
+    string self_;
+    vector<string> peers_;
+    unique_ptr<tcp::acceptor> acceptor_;
+
+    mutex m_;
+    vector<shared_ptr<ClusterLink>> links_;
+    FlatMap<shared_ptr<ClusterLink>> remote_users_;   // user id -> node they are on
+};
+
+unique_ptr<Cluster> cluster;
+
+// ======= Shard mesh =======
+// Every io thread is a shard: a room belongs to the shard its id hashes to,
+// a session to the one that accepted it. Work for another shard (a room op
+// for the room's owner, a frame for a session) goes through a lock-free
+// lane per (from, to) pair instead of the target io_context's locked
+// handler queue. Only the first item into an idle inbox posts a wakeup; the
+// target then runs everything queued since in one handler.
+
+// Unbounded single-producer single-consumer queue of fixed-size chunks. The
+// consumer passes each emptied chunk back through spare_ for reuse.
+template <typename T, size_t N = 64>
+class SpscQueue {
+public:
+    SpscQueue() : head_(new Chunk), tail_(head_) {}
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    ~SpscQueue() {
+        while (head_) delete exchange(head_, head_->next.load());
+        delete spare_.load();
+    }
+
+    // Producer thread only.
+    void push(T item) {
+        size_t i = tail_->written.load(memory_order_relaxed);
+        if (i == N) {
+            Chunk* c = spare_.exchange(nullptr, memory_order_acquire);
+            if (c) {
+                c->written.store(0, memory_order_relaxed);
+                c->next.store(nullptr, memory_order_relaxed);
+            } else {
+                c = new Chunk;
+            }
+            tail_->next.store(c, memory_order_release);
+            tail_ = c;
+            i = 0;
+        }
+        tail_->items[i] = std::move(item);
+        tail_->written.store(i + 1, memory_order_release);
+    }
+
+    // Consumer thread only.
+    bool pop(T& item) {
+        if (read_ == N) {
+            Chunk* next = head_->next.load(memory_order_acquire);
+            if (!next) return false;
+            delete spare_.exchange(exchange(head_, next), memory_order_acq_rel);
+            read_ = 0;
+        }
+        if (read_ == head_->written.load(memory_order_acquire)) return false;
+        item = std::move(head_->items[read_]);
+        head_->items[read_++] = T();
+        return true;
+    }
+
+private:
+    struct Chunk {
+        array<T, N> items;
+        atomic<size_t> written{0};
+        atomic<Chunk*> next{nullptr};
+    };
+
+    Chunk* head_;
+    size_t read_ = 0;
+    alignas(64) Chunk* tail_;
+    atomic<Chunk*> spare_{nullptr};
+};
+
+struct ShardTask {
+    shared_ptr<ChatSession> session;   // deliver frame to this session...
+    Frame frame;
+    Traffic traffic = Traffic::Control;
+    function<void()> run;              // ...or run this
+};
+
+class ShardMesh {
+public:
+    explicit ShardMesh(size_t shards) : n_(shards), lanes_(shards * shards), inboxes_(shards) {}
+
+    void deliver(size_t to, shared_ptr<ChatSession> session, Frame frame, Traffic traffic) {
+        send(to, {std::move(session), std::move(frame), traffic, nullptr});
+    }
+
+    void run(size_t to, function<void()> f) {
+        send(to, {nullptr, nullptr, Traffic::Control, std::move(f)});
+    }
+
+private:
+    // Caps one drain per lane, so a flood from one shard can't hold the
+    // target's thread away from its sockets.
+    static constexpr size_t drain_batch = 1024;
+
+    // Threads outside the pool have no lanes and post instead.
+    void send(size_t to, ShardTask task) {
+        if (this_shard >= n_) {
+            asio::post(io_pool->at(to), [task = std::move(task)]() mutable { execute(task); });
+            return;
+        }
+        lanes_[this_shard * n_ + to].push(std::move(task));
+        wake(to);
+    }
+
+    void wake(size_t to) {
+        if (!inboxes_[to].scheduled.exchange(true, memory_order_acq_rel)) {
+            asio::post(io_pool->at(to), [this, to] { drain(to); });
+        }
+    }
+
+    // Clearing the flag first means anything pushed from here on posts a
+    // fresh wakeup, so nothing is left behind.
+    void drain(size_t to) {
+        inboxes_[to].scheduled.exchange(false, memory_order_acq_rel);
+        bool more = false;
+        ShardTask task;
+        for (size_t from = 0; from < n_; ++from) {
+            auto& lane = lanes_[from * n_ + to];
+            size_t i = 0;
+            while (i < drain_batch && lane.pop(task)) {
+                execute(task);
+                ++i;
+            }
+            if (i == drain_batch) more = true;
+        }
+        if (more) wake(to);
+    }
+
+    static void execute(ShardTask& task);   // after ChatSession
+
+    struct alignas(64) Inbox {
+        atomic<bool> scheduled{false};
+    };
+
+    size_t n_;
+    vector<SpscQueue<ShardTask>> lanes_;   // lanes_[from * n_ + to]
+    vector<Inbox> inboxes_;
+};
+
+unique_ptr<ShardMesh> shard_mesh;
+
+// ======= Rooms =======
+
+// A session's seat in one room: its index in the room's member table. A new
+// seat is made for every join, and only the room's shard touches it.
+struct RoomSeat {
+    size_t slot = 0;
+    Render render = Render::Ansi;   // changed on the room's shard only
+    bool deflate = false;
+    uint64_t sent_in_batch = 0;   // batch generation this member last spoke in
+};
+
+// Each room is owned by one shard and only touched on that thread; rooms on
+// different shards handle membership and fan-out in parallel.
+// Members are kept in a dense array so a broadcast is a linear scan; leaving
+// swaps the last member into the freed slot.
+//
+// A batched room doesn't fan out each message as it arrives: messages are
+// held for up to batch_ms (or until batch_bytes), then every member gets the
+// whole tick as one frame. Members who spoke during the tick get their own
+// copy without their lines, as they would unbatched.
+struct Room {
+    Room(size_t owner, RoomId room_id, string room_name)
+        : shard(owner), id(room_id), name(std::move(room_name)),
+          batched(config.batched(name)), batch_timer(io_pool->at(owner)),
+          log(message_log ? message_log->open(name, id) : nullptr) {}
+
+    struct BatchEntry {
+        shared_ptr<RoomSeat> sender;
+        Message msg;
+    };
+
+    // Queues f to run on the room's shard.
+    void run(function<void()> f) { shard_mesh->run(shard, std::move(f)); }
+
+    void add(shared_ptr<ChatSession> s, const shared_ptr<RoomSeat>& seat) {
+        seat->slot = members.size();
+        members.push_back(std::move(s));
+        seats.push_back(seat);
+        member_count = members.size();
+        if (seat->render == Render::Binary) ++binary_members;
+        if (seat->render == Render::Plain) ++plain_members;
+        if (seat->deflate) ++deflate_members[size_t(seat->render)];
+        by_shard.clear();
+        room_listing.touch();
+        if (cluster && members.size() == 1) cluster->set_interest(name, true);
+    }
+
+    void remove(const shared_ptr<RoomSeat>& seat) {
+        size_t i = seat->slot;
+        if (i >= seats.size() || seats[i] != seat) return;
+        if (seat->render == Render::Binary) --binary_members;
+        if (seat->render == Render::Plain) --plain_members;
+        if (seat->deflate) --deflate_members[size_t(seat->render)];
+        if (i != members.size() - 1) {
+            members[i] = std::move(members.back());
+            seats[i] = std::move(seats.back());
+            seats[i]->slot = i;
+        }
+        members.pop_back();
+        seats.pop_back();
+        member_count = members.size();
+        by_shard.clear();
+        room_listing.touch();
+        if (cluster && members.empty()) cluster->set_interest(name, false);
+    }
+
+    // Logs msg and keeps it in log_tail until the writer has committed it.
+    void append_log(const Message& msg) {
+        uint64_t seq = log->next_seq;
+        if (!message_log->append(log, msg)) {
+            if (log->failed) log_tail.clear();
+            return;
+        }
+        uint64_t committed = log->committed;
+        while (!log_tail.empty() && log_tail.front().first < committed) log_tail.pop_front();
+        log_tail.emplace_back(seq, msg);
+    }
+
+    // Up to n of the latest logged messages, oldest first: committed ones
+    // from the log, then the rest from log_tail. Whatever is fanned out
+    // after this call is not among them.
+    template <typename F>
+    void replay_log(size_t n, F&& f) {
+        uint64_t upto = log->committed;
+        while (!log_tail.empty() && log_tail.front().first < upto) log_tail.pop_front();
+        size_t from_tail = min(n, log_tail.size());
+        if (n > from_tail) message_log->replay(*log, n - from_tail, upto, f);
+        for (size_t i = log_tail.size() - from_tail; i < log_tail.size(); ++i) f(log_tail[i].second);
+    }
+
+    void set_render(const shared_ptr<RoomSeat>& seat, Render render) {
+        size_t i = seat->slot;
+        if (i >= seats.size() || seats[i] != seat) return;
+        if (seat->render == Render::Plain) --plain_members;
+        if (seat->deflate) --deflate_members[size_t(seat->render)];
+        seat->render = render;
+        if (render == Render::Plain) ++plain_members;
+        if (seat->deflate) ++deflate_members[size_t(render)];
+    }
+
+    // msg with a deflate record for every rendering a deflate member gets.
+    Message deflated(const Message& msg) const {
+        Message out = msg;
+        if (deflate_members[size_t(Render::Ansi)] && msg.text) out.ztext = deflate_frame(msg.text);
+        if (deflate_members[size_t(Render::Plain)]) {
+            if (!msg.plain) {
+                if (!out.ztext && msg.text) out.ztext = deflate_frame(msg.text);
+            } else {
+                out.zplain = deflate_frame(msg.plain);
+            }
+        }
+        if (deflate_members[size_t(Render::Binary)] && msg.binary) out.zbinary = deflate_frame(msg.binary);
+        return out;
+    }
+
+    bool has_deflate_members() const {
+        return deflate_members[0] || deflate_members[1] || deflate_members[2];
+    }
+
+    void add_remote(const shared_ptr<ClusterLink>& link) {
+        remote_links.push_back(link);
+        remote_count = remote_links.size();
+    }
+
+    void remove_remote(const shared_ptr<ClusterLink>& link) {
+        remote_links.erase(std::remove(remote_links.begin(), remote_links.end(), link), remote_links.end());
+        remote_count = remote_links.size();
+    }
+
+    const size_t shard;
+    const RoomId id;
+    const string name;
+    vector<shared_ptr<ChatSession>> members;   // shard only
+    vector<shared_ptr<RoomSeat>> seats;        // shard only, parallel to members
+    atomic<size_t> member_count{0};
+    atomic<size_t> binary_members{0};
+    atomic<size_t> plain_members{0};
+    array<size_t, 3> deflate_members{};        // shard only, by Render
+
+    // Large rooms only: members by the shard their session is on, dropped on
+    // every join or leave and rebuilt by the next fan-out (see
+    // ChatSession::fan_out).
+    using Partition = vector<shared_ptr<ChatSession>>;
+    vector<shared_ptr<const Partition>> by_shard;   // shard only
+
+    const bool batched;
+    asio::steady_timer batch_timer;    // on the shard's context, like the batch itself
+    vector<BatchEntry> batch;
+    size_t batch_bytes = 0;
+    uint64_t batch_gen = 1;
+    bool batch_armed = false;
+
+    const shared_ptr<RoomLog> log;     // null unless --log-dir
+    deque<pair<uint64_t, Message>> log_tail;   // shard only: logged, not yet committed, by sequence number
+    RateLimiter limiter{config.room_rate, config.room_burst};
+
+    // cluster nodes with members here; each gets one copy of every local message
+    vector<shared_ptr<ClusterLink>> remote_links;   // shard only
+    atomic<size_t> remote_count{0};
+    const shared_ptr<RoomSeat> remote_seat = make_shared<RoomSeat>();   // batches remote senders
+};
+
+// Room names are interned into a RoomId on first use; rooms are then found
+// by id in sharded open-addressing maps so joins in different rooms don't
+// contend on one lock.
+class RoomDirectory {
+public:
+    // Null once --max-names room names have been used.
+    shared_ptr<Room> find_or_create(string_view name) {
+        RoomId id = names_.intern(name, config.max_names);
+        if (!id) return nullptr;
+        Shard& shard = shards_[id % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        if (auto* room = shard.rooms.find(id)) return *room;
+        room_listing.insert(names_.name(id));
+        return shard.rooms.insert_or_assign(id, make_shared<Room>(id % io_pool->size(), id, string(name)));
+    }
+
+    shared_ptr<Room> find(string_view name) {
+        RoomId id = names_.find(name);
+        return id ? find(id) : nullptr;
+    }
+
+    shared_ptr<Room> find(RoomId id) {
+        Shard& shard = shards_[id % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        auto* room = shard.rooms.find(id);
+        return room ? *room : nullptr;
+    }
+
+    // Rooms owned by one io thread.
+    vector<shared_ptr<Room>> on_shard(size_t owner) {
+        vector<shared_ptr<Room>> out;
+        for (auto& shard : shards_) {
+            lock_guard<mutex> lock(shard.m);
+            shard.rooms.for_each([&](RoomId, shared_ptr<Room>& r) {
+                if (r->shard == owner) out.push_back(r);
+            });
+        }
+        return out;
+    }
+
+    // Names of rooms that currently have members.
+    vector<string> occupied() {
+        vector<string> out;
+        for (auto& shard : shards_) {
+            lock_guard<mutex> lock(shard.m);
+            shard.rooms.for_each([&](RoomId, shared_ptr<Room>& r) {
+                if (r->member_count > 0) out.push_back(r->name);
+            });
+        }
+        return out;
+    }
+
+private:
+    struct Shard {
+        mutex m;
+        FlatMap<shared_ptr<Room>> rooms;
+    };
+    SymbolTable names_;
+    array<Shard, 16> shards_;
+};
+
+RoomDirectory rooms;
+
+// ======= Presence =======
+// Joins and leaves are not broadcast as they happen. Each one is recorded in
+// a shard keyed by user id, and a timer gathers every shard once per
+// presence_ms into a single digest for the subscribed sessions. A leave and
+// a rejoin within one tick (a reconnect) cancel out, and a digest names at
+// most presence_names users per direction, so presence traffic per tick
+// stays bounded however much churn there is.
+class Presence {
+public:
+    void start(asio::io_context& io) {
+        timer_ = make_unique<asio::steady_timer>(io);
+        arm();
+    }
+
+    void joined(SymbolId user) { record(user, 1); }
+    void left(SymbolId user) { record(user, -1); }
+
+    void subscribe(SymbolId user, shared_ptr<ChatSession> s) {
+        Shard& shard = shards_[user % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        shard.subscribers.insert_or_assign(user, std::move(s));
+    }
+
+    void unsubscribe(SymbolId user) {
+        Shard& shard = shards_[user % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        shard.subscribers.erase(user);
+    }
+
+private:
+    struct Shard {
+        mutex m;
+        FlatMap<int> changes;   // net joins minus leaves this tick
+        FlatMap<shared_ptr<ChatSession>> subscribers;
+    };
+
+    void record(SymbolId user, int delta) {
+        Shard& shard = shards_[user % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        int* c = shard.changes.find(user);
+        if (!c) {
+            shard.changes.insert_or_assign(user, delta);
+        } else if ((*c += delta) == 0) {
+            shard.changes.erase(user);
+        }
+    }
+
+    void arm() {
+        timer_->expires_after(chrono::milliseconds(config.presence_ms));
+        timer_->async_wait([this](asio::error_code ec) {
+            if (ec) return;
+            flush();
+            arm();
+        });
+    }
+
+    void flush();
+
+    unique_ptr<asio::steady_timer> timer_;
+    array<Shard, 16> shards_;
+};
+
+Presence presence;
+
+// ======= Mailbox =======
+// PV messages for users who are known but offline wait here until they next
+// sign in. A user's mailbox is one packed buffer of records
+//   sender id (4) | text length (4) | text
+// owned by the mailbox, so nothing pins a sender's receive buffer. Every
+// stored byte counts against the recipient's mailbox_bytes and against the
+// global mailbox_total_bytes; messages past either limit are refused.
+class Mailbox {
+public:
+    bool store(SymbolId to, SymbolId from, string_view text) {
+        size_t need = 8 + text.size();
+        Shard& shard = shards_[to % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        FrameString* box = shard.boxes.find(to);
+        if ((box ? box->size() : 0) + need > config.mailbox_bytes) return false;
+        if (total_.fetch_add(need) + need > config.mailbox_total_bytes) {
+            total_ -= need;
+            return false;
+        }
+        if (!box) box = &shard.boxes.insert_or_assign(to, FrameString());
+        char head[8];
+        put_u32(head, from);
+        put_u32(head + 4, uint32_t(text.size()));
+        box->append(head, sizeof(head));
+        box->append(text.data(), text.size());
+        return true;
+    }
+
+    FrameString take(SymbolId user) {
+        Shard& shard = shards_[user % shards_.size()];
+        lock_guard<mutex> lock(shard.m);
+        FrameString out;
+        if (auto* box = shard.boxes.find(user)) {
+            out = std::move(*box);
+            shard.boxes.erase(user);
+            total_ -= out.size();
+        }
+        return out;
+    }
+
+    // Empties every box through f(to, box); for a handoff.
+    template <typename F>
+    void take_all(F&& f) {
+        for (auto& shard : shards_) {
+            lock_guard<mutex> lock(shard.m);
+            shard.boxes.for_each([&](SymbolId to, FrameString& box) {
+                total_ -= box.size();
+                f(to, box);
+            });
+            shard.boxes = FlatMap<FrameString>();
+        }
+    }
+
+    template <typename F>
+    static void for_each(const FrameString& box, F&& f) {
+        for (size_t off = 0; off + 8 <= box.size();) {
+            SymbolId from = get_u32(box.data() + off);
+            uint32_t n = get_u32(box.data() + off + 4);
+            f(from, string_view(box.data() + off + 8, n));
+            off += 8 + n;
+        }
+    }
+
+    size_t bytes() const { return total_; }
+
+private:
+    struct Shard {
+        mutex m;
+        FlatMap<FrameString> boxes;
+    };
+    array<Shard, 16> shards_;
+    atomic<size_t> total_{0};
+};
+
+Mailbox mailbox;
+
+// ======= Handoff state =======
+// A session on its way to a new process (see Restart). The fd travels as
+// SCM_RIGHTS; the rest is one packet on the handoff socket:
+//   'S' | protocol (1) | render (1) | mode (1) | flags (1) | 4 x (length (4) | bytes)
+// where the strings are the name, room, PV peer and input not yet acted on.
+struct HandoffState {
+    string name, room, pv, input;
+    Protocol protocol = Protocol::Text;
+    Render render = Render::Ansi;
+    Mode mode = Mode::None;
+    bool negotiated = false;
+    bool presence = true;
+    bool deflate = false;
+    int fd = -1;
+};
+
+string encode_handoff(const HandoffState& st) {
+    string out = "S";
+    out += char(st.protocol);
+    out += char(st.render);
+    out += char(st.mode);
+    out += char((st.negotiated ? 1 : 0) | (st.presence ? 2 : 0) | (st.deflate ? 4 : 0));
+    for (const string* s : {&st.name, &st.room, &st.pv, &st.input}) {
+        char len[4];
+        put_u32(len, uint32_t(s->size()));
+        out.append(len, sizeof(len));
+        out += *s;
+    }
+    return out;
+}
+
+bool decode_handoff(string_view in, HandoffState& st) {
+    if (in.size() < 5 || in[0] != 'S') return false;
+    st.protocol = Protocol(uint8_t(in[1]));
+    st.render = Render(uint8_t(in[2]));
+    st.mode = Mode(uint8_t(in[3]));
+    st.negotiated = in[4] & 1;
+    st.presence = in[4] & 2;
+    st.deflate = in[4] & 4;
+    in.remove_prefix(5);
+    for (string* s : {&st.name, &st.room, &st.pv, &st.input}) {
+        if (in.size() < 4 || in.size() - 4 < get_u32(in.data())) return false;
+        s->assign(in.data() + 4, get_u32(in.data()));
+        in.remove_prefix(4 + s->size());
+    }
+    return true;
+}
+
+// A mailbox message for an offline user, sent after the sessions:
+//   'M' | 3 x (length (4) | bytes)
+// for the recipient, the sender and the text.
+struct HandoffMail {
+    string to, from, text;
+};
+
+string encode_mail(const HandoffMail& m) {
+    string out = "M";
+    for (const string* s : {&m.to, &m.from, &m.text}) {
+        char len[4];
+        put_u32(len, uint32_t(s->size()));
+        out.append(len, sizeof(len));
+        out += *s;
+    }
+    return out;
+}
+
+bool decode_mail(string_view in, HandoffMail& m) {
+    if (in.empty() || in[0] != 'M') return false;
+    in.remove_prefix(1);
+    for (string* s : {&m.to, &m.from, &m.text}) {
+        if (in.size() < 4 || in.size() - 4 < get_u32(in.data())) return false;
+        s->assign(in.data() + 4, get_u32(in.data()));
+        in.remove_prefix(4 + s->size());
+    }
+    return true;
+}
+
+// Takes each session's state as it lets go of its socket; fd < 0 if the
+// session could not be moved.
+void handoff_report(HandoffState st);
+
+// ======= Commands =======
+enum class Command : uint8_t {
+    Join, Pv, Leave, WhereAmI, Rooms, Users, History, Presence, Pong, Stats, Colors
+};
+
+struct CommandSpec {
+    string_view name;
+    bool needs_args;
+    string_view usage;
+};
+
+// Indexed by Command.
+constexpr array<CommandSpec, 11> command_specs = {{
+    {"/join", true, "/join <room>"},
+    {"/pv", true, "/pv <user>"},
+    {"/leave", false, "/leave"},
+    {"/whereami", false, "/whereami"},
+    {"/rooms", false, "/rooms [after]"},
+    {"/users", false, "/users [prefix|*] [after]"},
+    {"/history", false, "/history [n]"},
+    {"/presence", true, "/presence on|off"},
+    {"/pong", false, "/pong"},
+    {"/stats", false, "/stats"},
+    {"/color", true, "/color on|off"},
+}};
+
+// A perfect hash over the names above: length, second and last character,
+// mixed by a multiplier that the compiler searches for. A new command that
+// no multiplier separates from the others fails to compile instead of
+// misrouting.
+constexpr size_t command_hash(string_view token, uint32_t mul) {
+    uint32_t h = uint32_t(token.size());
+    h = h * mul + uint8_t(token[1]);
+    h = h * mul + uint8_t(token.back());
+    return (h * mul) >> 27;   // top 5 bits: 32 slots
+}
+
+constexpr bool command_hash_separates(uint32_t mul) {
+    uint32_t used = 0;
+    for (auto& spec : command_specs) {
+        uint32_t bit = uint32_t(1) << command_hash(spec.name, mul);
+        if (used & bit) return false;
+        used |= bit;
+    }
+    return true;
+}
+
+constexpr uint32_t find_command_mul() {
+    for (uint32_t mul = 3; mul < (1u << 16); mul += 2) {
+        if (command_hash_separates(mul)) return mul;
+    }
+    return 0;
+}
+
+constexpr uint32_t command_mul = find_command_mul();
+static_assert(command_mul != 0, "no multiplier gives every command its own slot");
+
+constexpr size_t command_slot(string_view token) { return command_hash(token, command_mul); }
+
+constexpr array<int8_t, 32> make_command_slots() {
+    array<int8_t, 32> slots{};
+    for (auto& slot : slots) slot = -1;
+    for (size_t i = 0; i < command_specs.size(); ++i) slots[command_slot(command_specs[i].name)] = int8_t(i);
+    return slots;
+}
+
+constexpr array<int8_t, 32> command_slots = make_command_slots();
+
+optional<Command> find_command(string_view token) {
+    if (token.size() < 2) return nullopt;
+    int8_t i = command_slots[command_slot(token)];
+    if (i < 0 || command_specs[size_t(i)].name != token) return nullopt;
+    return Command(i);
+}
+
+// The text command a client opcode stands for, so packets get the same
+// argument checks.
+optional<Command> packet_command(Op op) {
+    switch (op) {
+    case Op::Join: return Command::Join;
+    case Op::Pv: return Command::Pv;
+    case Op::Leave: return Command::Leave;
+    case Op::WhereAmI: return Command::WhereAmI;
+    case Op::Rooms: return Command::Rooms;
+    case Op::Users: return Command::Users;
+    case Op::Stats: return Command::Stats;
+    case Op::Presence: return Command::Presence;
+    case Op::Pong: return Command::Pong;
+    default: return nullopt;
+    }
+}
+
+class ChatSession : public enable_shared_from_this<ChatSession> {
+public:
+    ChatSession(asio::io_context& io, size_t shard, tcp::socket socket, TimingWheel<ChatSession>* wheel)
+        : executor_(io.get_executor()),
+          shard_(shard),
+          socket_(std::move(socket)),
+#ifdef CHAT_COROUTINES
+          wake_(io),
+#endif
+          wheel_(wheel),
+          framer_(config.max_line),
+          writing_(false),
+          has_name_(false),
+          closed_(false),
+          mode_(Mode::None) {
+        color_ = name_colors[color_index++ % name_colors.size()];
+    }
+
+    void start() {
+        auto self = shared_from_this();
+        asio::post(executor_, [this, self] {
+            {
+                lock_guard<mutex> lock(sessions_mutex);
+                sessions.insert(self);
+            }
+            deliver("Welcome! Please enter your name: ");
+            start_reading();
+        });
+    }
+
+    // Carries on a session handed over by the previous process: same user,
+    // same room or PV, and the input it had not acted on yet. Nobody is
+    // told it was ever gone.
+    void resume(HandoffState st) {
+        auto self = shared_from_this();
+        asio::post(executor_, [this, self, st = std::move(st)] {
+            {
+                lock_guard<mutex> lock(sessions_mutex);
+                sessions.insert(self);
+            }
+            if (st.deflate && !deflate_available) {
+                close();   // its client expects records this build can't make
+                return;
+            }
+            deflate_ = st.deflate;
+            protocol_ = st.protocol;
+            negotiated_ = st.negotiated;
+            render_ = protocol_ == Protocol::Binary ? Render::Binary : st.render;
+            if (!st.name.empty()) {
+                if (sign_in(st.name)) {
+                    presence_on_ = st.presence;
+                    if (presence_on_) presence.subscribe(user_id_, self);
+                    if (cluster) cluster->user_online(name_);
+                    if (st.mode == Mode::Room) {
+                        switch_to_room(st.room, true);
+                    } else if (st.mode == Mode::Pv) {
+                        pv_id_ = user_names.intern(st.pv, config.max_names);
+                        if (pv_id_) mode_ = Mode::Pv;
+                    }
+                } else {
+                    reject_name(st.name);
+                }
+            }
+            framer_.preload(st.input);
+            start_reading();
+        });
+    }
+
+    // Drain: a last word, then close once the outbox is written.
+    void shut_down() {
+        auto self = shared_from_this();
+        asio::post(executor_, [this, self] {
+            if (closed_) return;
+            deliver("Server is shutting down.\n");
+            close_after_flush();
+        });
+    }
+
+    // Handoff: stops acting on input and, once the outbox is written,
+    // lets go of the socket. Sessions already closing are not moved.
+    void freeze() {
+        auto self = shared_from_this();
+        asio::post(executor_, [this, self] {
+            if (closed_ || closing_) {
+                handoff_report({});
+                return;
+            }
+            frozen_ = true;
+            if (!writing_) hand_off();
+        });
+    }
+
+    // Called by the timing wheel, on this session's thread.
+    void on_wheel() {
+        if (closed_) return;
+        if (closing_) {
+            close();   // the farewell didn't flush within a tick; don't wait on a dead peer
+            return;
+        }
+        uint64_t now = wheel_->now();
+        if (!has_name_ && config.handshake_secs && now >= accepted_tick_ + config.handshake_secs) {
+            time_out("Timed out waiting for your name.\n");
+            return;
+        }
+        if (config.idle_secs && now >= last_input_tick_ + config.idle_secs) {
+            time_out("Disconnected after " + to_string(config.idle_secs) + "s without input.\n");
+            return;
+        }
+        if (has_name_ && config.ping_secs && now >= max(last_input_tick_, last_ping_tick_) + config.ping_secs) {
+            if (protocol_ == Protocol::Binary) {
+                deliver(make_packet(Op::Ping, 0, {}), Traffic::Control);
+            } else {
+                deliver("PING\n");
+            }
+            last_ping_tick_ = now;
+        }
+        schedule_timeout();
+    }
+
+    // Direct replies: plain text, or an Info packet for binary clients.
+    void deliver(string_view msg) {
+        if (protocol_ == Protocol::Binary) {
+            if (!msg.empty() && msg.back() == '\n') msg.remove_suffix(1);
+            deliver(make_packet(Op::Info, 0, {msg}));
+        } else {
+            deliver(make_frame(msg));
+        }
+    }
+
+    // Picks this session's rendering of a fan-out message.
+    void deliver(const Message& msg, Traffic traffic) {
+        const Frame& frame = msg.for_render(render_.load(memory_order_relaxed), deflate_.load(memory_order_relaxed));
+        if (frame) deliver(frame, traffic);
+    }
+
+    // Safe to call from any thread; the frame is queued on the session's own.
+    void deliver(Frame frame, Traffic traffic = Traffic::Control) {
+        if (executor_.running_in_this_thread()) {
+            enqueue(std::move(frame), traffic);
+            return;
+        }
+        shard_mesh->deliver(shard_, shared_from_this(), std::move(frame), traffic);
+    }
+
+private:
+    struct Outgoing {
+        Frame frame;
+        Traffic traffic;
+    };
+
+    void enqueue(Frame frame, Traffic traffic) {
+        if (closed_) return;
+        if (deflate_.load(memory_order_relaxed) && !frame->deflated) frame = deflate_frame(frame);
+        auto& m = metrics();
+        m.queued_frames.add(1);
+        m.queued_bytes.add(frame->size());
+        queued_bytes_ += frame->footprint();
+        outbox_.push_back({std::move(frame), traffic});
+        if (over_high_water()) apply_overflow_policy();
+        if (writing_ || closed_) return;
+#ifdef CHAT_COROUTINES
+        writing_ = true;
+        wake_.cancel();
+#else
+        do_write();
+#endif
+    }
+
+    bool over_high_water() const {
+        return queued_bytes_ > config.out_max_bytes || outbox_.size() > config.out_max_msgs;
+    }
+
+    // A slow consumer has caught up once a write leaves less than half the
+    // mark queued; until then its grace period keeps running.
+    bool under_low_water() const {
+        return queued_bytes_ <= config.out_max_bytes / 2 && outbox_.size() <= config.out_max_msgs / 2;
+    }
+
+    deque<Outgoing>::iterator drop_queued(deque<Outgoing>::iterator it, atomic<uint64_t>& counter) {
+        size_t n = it->frame->size();
+        ++counter;
+        backpressure_stats.dropped_bytes += n;
+        queued_bytes_ -= it->frame->footprint();
+        metrics().queued_frames.add(-1);
+        metrics().queued_bytes.add(-int64_t(n));
+        return outbox_.erase(it);
+    }
+
+    // Only the not-yet-written outbox is ever shed; the in-flight write is
+    // left alone. The disconnect policy tolerates the overflow for
+    // slow_grace_secs, but never lets the queue grow past 4x the limit.
+    void apply_overflow_policy() {
+        switch (config.overflow) {
+        case OverflowPolicy::DropNonPv:
+            for (auto it = outbox_.begin(); it != outbox_.end() && over_high_water();) {
+                if (it->traffic == Traffic::Room || it->traffic == Traffic::Broadcast) {
+                    it = drop_queued(it, backpressure_stats.dropped_non_pv);
+                } else {
+                    ++it;
+                }
+            }
+            [[fallthrough]];
+        case OverflowPolicy::DropOldest:
+            while (over_high_water() && outbox_.size() > 1) {
+                drop_queued(outbox_.begin(), backpressure_stats.dropped_oldest);
+            }
+            break;
+        case OverflowPolicy::Disconnect: {
+            auto now = chrono::steady_clock::now();
+            if (!over_since_) over_since_ = now;
+            bool expired = now - *over_since_ >= chrono::seconds(config.slow_grace_secs);
+            bool hard_cap = queued_bytes_ > 4 * config.out_max_bytes || outbox_.size() > 4 * config.out_max_msgs;
+            if (expired || hard_cap) {
+                ++backpressure_stats.slow_disconnects;
+                close();
+            }
+            break;
+        }
+        }
+    }
+
+    // Only one async_write is in flight per socket; everything queued while it
+    // runs goes out as a single gathered write when it completes.
+    void begin_write() {
+        writing_ = true;
+        inflight_.swap(outbox_);
+        queued_bytes_ = 0;
+        if (config.trace_sample) write_started_ = Clock::now();
+        write_bufs_.clear();
+        for (auto& o : inflight_) o.frame->gather(write_bufs_);
+    }
+
+    void end_write(std::error_code ec, size_t written) {
+        auto& m = metrics();
+        auto now = Clock::now();
+        int64_t bytes = 0;
+        for (auto& o : inflight_) {
+            bytes += int64_t(o.frame->size());
+            if (!ec) {
+                auto us = chrono::duration_cast<chrono::microseconds>(now - o.frame->origin).count();
+                m.read_to_deliver_us.record(uint64_t(max<int64_t>(0, us)));
+                trace_span(o.frame->trace, TraceStage::Write, write_started_, now);
+            }
+        }
+        m.bytes_written.add(written);
+        m.queued_frames.add(-int64_t(inflight_.size()));
+        m.queued_bytes.add(-bytes);
+        inflight_.clear();
+        writing_ = false;
+        if (!ec && over_since_ && under_low_water()) over_since_.reset();
+    }
+
+    // Takes in a read; true if the next read should be started right away.
+    bool on_read(size_t length) {
+        framer_.commit(length);
+        if (wheel_) last_input_tick_ = wheel_->now();
+        if (frozen_) return false;   // kept for the next process
+        DispatchScope scope(Clock::now());
+        if (!negotiated_ && !negotiate()) return true;
+        return dispatch();
+    }
+
+#ifdef CHAT_COROUTINES
+    // One reader and one writer coroutine per connection, each holding
+    // the session for its whole life instead of one shared_ptr per
+    // operation. The writer sleeps on wake_ while the outbox is empty;
+    // enqueue() cancels the wait. writing_ is true whenever the writer owes
+    // the outbox a pass, so close_after_flush() still waits for it.
+    asio::awaitable<void> write_loop([[maybe_unused]] shared_ptr<ChatSession> self) {
+        asio::error_code ec;
+        while (!closed_) {
+            if (outbox_.empty()) {
+                if (closing_) {
+                    close();
+                    break;
+                }
+                if (frozen_) {
+                    hand_off();
+                    break;
+                }
+                writing_ = false;
+                wake_.expires_at(Clock::time_point::max());
+                co_await wake_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                continue;
+            }
+            begin_write();
+            size_t written = co_await asio::async_write(socket_, write_bufs_,
+                                                        asio::redirect_error(asio::use_awaitable, ec));
+            end_write(ec, written);
+            if (ec) {
+                cleanup();
+                break;
+            }
+        }
+    }
+
+    // A throttled reader waits out pause_timer_ here rather than reading on.
+    // The first pass reads nothing, taking in only input a handoff preloaded.
+    asio::awaitable<void> read_loop([[maybe_unused]] shared_ptr<ChatSession> self) {
+        asio::error_code ec;
+        size_t n = 0;
+        while (true) {
+            bool more = on_read(n);
+            while (!more && !closing_ && !closed_ && !frozen_) {
+                co_await pause_timer_->async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                if (ec || closed_ || frozen_) co_return;
+                more = dispatch();
+            }
+            if (!more) co_return;
+            n = co_await socket_.async_read_some(framer_.prepare(),
+                                                 asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                cleanup();
+                co_return;
+            }
+        }
+    }
+#else
+    void do_write() {
+        begin_write();
+        auto self = shared_from_this();
+        asio::async_write(
+            socket_,
+            write_bufs_,
+            make_alloc_handler(write_mem_, [this, self](std::error_code ec, size_t written) {
+                end_write(ec, written);
+                if (ec) {
+                    cleanup();
+                    return;
+                }
+                if (!outbox_.empty()) {
+                    do_write();
+                } else if (closing_) {
+                    close();
+                } else if (frozen_) {
+                    hand_off();
+                }
+            })
+        );
+    }
+
+    void do_read() {
+        auto self = shared_from_this();
+        socket_.async_read_some(
+            framer_.prepare(),
+            make_alloc_handler(read_mem_, [this, self](std::error_code ec, std::size_t length) {
+                if (ec) {
+                    cleanup();
+                } else if (on_read(length)) {
+                    do_read();
+                }
+            })
+        );
+    }
+#endif
+
+    // Input a handoff preloaded is taken in before the first read.
+    void start_reading() {
+#ifdef CHAT_COROUTINES
+        auto self = shared_from_this();
+        asio::co_spawn(executor_, write_loop(self), asio::detached);
+        asio::co_spawn(executor_, read_loop(self), asio::detached);
+#else
+        if (on_read(0)) do_read();
+#endif
+        if (wheel_) {
+            accepted_tick_ = last_input_tick_ = wheel_->now();
+            schedule_timeout();
+        }
+    }
+
+    // A binary client opens with binary_magic; anything else is text. Either
+    // may be preceded by deflate_magic. Returns false while there isn't
+    // enough input to tell.
+    bool negotiate() {
+        string_view in = framer_.pending();
+        if (in.empty()) return false;
+        if (in[0] == binary_magic[0]) {
+            if (in.size() < binary_magic.size()) return false;
+            if (in.substr(0, deflate_magic.size()) == deflate_magic) {
+                framer_.consume(deflate_magic.size());
+                if (deflate_available && config.deflate_level > 0) {
+                    char len[2] = {char(deflate_dictionary.size() >> 8), char(deflate_dictionary.size())};
+                    deliver(make_frame({deflate_magic, string_view(len, 2), deflate_dictionary}), Traffic::Control);
+                    deflate_ = true;
+                } else {
+                    deliver(make_frame(deflate_refused), Traffic::Control);
+                }
+                return negotiate();
+            }
+            if (in.substr(0, binary_magic.size()) == binary_magic) {
+                framer_.consume(binary_magic.size());
+                protocol_ = Protocol::Binary;
+                render_ = Render::Binary;
+                deliver(make_frame(binary_magic), Traffic::Control);
+            }
+        }
+        negotiated_ = true;
+        return true;
+    }
+
+    // Handles everything complete in the framer. False if reading should
+    // not go on: the session is closing, or over a rate limit.
+    bool dispatch() {
+        return protocol_ == Protocol::Binary ? read_packets() : read_lines();
+    }
+
+    bool read_lines() {
+        string_view line;
+        while (framer_.next_line(line)) {
+            string_view t = trim(line);
+            bool room_chat = has_name_ && mode_ == Mode::Room && !t.empty() && t.front() != '/';
+            if (auto wait = throttle(room_chat); wait.count()) {
+                framer_.unread(line);
+                pause_reads(wait);
+                return false;
+            }
+            metrics().frames_in.add();
+            TraceScope trace;
+            handle_line(line);
+        }
+        if (framer_.take_overflows()) {
+            deliver("Line too long (max " + to_string(config.max_line) + " bytes), dropped.\n");
+        }
+        return !closing_ && !closed_;
+    }
+
+    // Zero if the next line may go through now, else how long to hold off.
+    Clock::duration throttle(bool room_chat) {
+        auto now = Clock::now();
+        auto wait = limiter_.acquire(now);
+        if (wait.count() || !room_chat || !room_) return wait;
+        wait = room_->limiter.acquire(now);
+        if (wait.count()) limiter_.refund();
+        return wait;
+    }
+
+    // Stops reading until the buckets have refilled; meanwhile the socket's
+    // receive window fills and TCP slows the sender down.
+    void pause_reads(Clock::duration wait) {
+        metrics().throttled.add();
+        if (!pause_timer_) pause_timer_.emplace(executor_);
+        pause_timer_->expires_after(wait);
+#ifndef CHAT_COROUTINES
+        pause_timer_->async_wait([this, self = shared_from_this()](asio::error_code ec) {
+            if (ec || closed_ || frozen_) return;
+            if (dispatch()) do_read();
+        });
+#endif
+    }
+
+    // Returns false if the session was closed on a protocol error.
+    bool read_packets() {
+        PacketHeader header;
+        string_view payload;
+        while (true) {
+            auto status = framer_.next_packet(header, payload);
+            if (status == InputFramer::PacketStatus::Incomplete) return true;
+            if (status == InputFramer::PacketStatus::TooLarge) {
+                deliver(make_packet(Op::Error, 0, {"packet too large"}), Traffic::Control);
+                close_after_flush();
+                return false;
+            }
+            bool room_chat = has_name_ && mode_ == Mode::Room && header.op == Op::Chat;
+            if (auto wait = throttle(room_chat); wait.count()) {
+                framer_.unread_packet(payload);
+                pause_reads(wait);
+                return false;
+            }
+            metrics().frames_in.add();
+            TraceScope trace;
+            handle_packet(header, payload);
+        }
+    }
+
+    // The binary protocol maps each opcode onto the same handlers text
+    // commands use, with the payload as the argument, checked like a line.
+    void handle_packet(const PacketHeader& header, string_view payload) {
+        if (header.op == Op::Pong) return;
+        auto arg = clean_input(payload);
+        if (!arg) {
+            deliver(make_packet(Op::Error, header.id, {"control characters are not allowed"}), Traffic::Control);
+            return;
+        }
+        if (!has_name_) {
+            if (header.op == Op::Name && !arg->empty()) {
+                handle_name(*arg);
+            } else {
+                deliver(make_packet(Op::Error, 0, {"send Name first"}), Traffic::Control);
+            }
+            return;
+        }
+        if (auto cmd = packet_command(header.op); cmd && command_specs[size_t(*cmd)].needs_args && arg->empty()) {
+            deliver(make_packet(Op::Error, header.id, {"usage: ", command_specs[size_t(*cmd)].usage}),
+                    Traffic::Control);
+            return;
+        }
+        payload = *arg;
+        switch (header.op) {
+        case Op::Chat:
+            if (!payload.empty()) send_message(payload);
+            break;
+        case Op::Join: switch_to_room(payload); break;
+        case Op::Pv: switch_to_pv(payload); break;
+        case Op::Leave:
+            leave_all();
+            deliver("You left all contexts. Mode: none.\n");
+            break;
+        case Op::WhereAmI: report_whereami(); break;
+        case Op::Rooms: list_rooms(payload); break;
+        case Op::Users: list_users(payload); break;
+        case Op::Stats: report_stats(); break;
+        case Op::Presence: set_presence(payload); break;
+        default:
+            deliver(make_packet(Op::Error, header.id, {"unknown opcode"}), Traffic::Control);
+            break;
+        }
+    }
+
+    void handle_line(string_view line) {
+        auto clean = clean_input(line);
+        if (!clean) {
+            deliver("Control characters are not allowed.\n");
+            return;
+        }
+        string_view msg = *clean;
+        if (msg.empty()) return;
+
+        if (!has_name_) {
+            handle_name(msg);
+        } else {
+            handle_command_or_message(msg);
+        }
+    }
+
+    void handle_name(string_view name) {
+        if (!sign_in(name)) {
+            reject_name(name);
+            return;
+        }
+        if (protocol_ == Protocol::Binary) {
+            deliver(make_packet(Op::Welcome, user_id_, {name_}), Traffic::Control);
+        } else {
+            deliver("Hi " + (render_ == Render::Plain ? name_ : colored_name_) + "! Commands: "
+                    "/join <room>, /pv <user>, /leave, /whereami, /rooms, /users, /history [n], "
+                    "/stats, /presence on|off, /color on|off\n");
+        }
+        presence.joined(user_id_);
+        presence.subscribe(user_id_, shared_from_this());
+        if (cluster) cluster->user_online(name_);
+        drain_mailbox();
+    }
+
+    void reject_name(string_view name) {
+        if (!user_names.find(name)) {
+            if (protocol_ == Protocol::Binary) {
+                deliver(make_packet(Op::Error, 0, {"no new names accepted"}), Traffic::Control);
+            } else {
+                deliver("This server takes no new names; sign in with one used before: ");
+            }
+        } else if (protocol_ == Protocol::Binary) {
+            deliver(make_packet(Op::Error, 0, {"name already taken"}), Traffic::Control);
+        } else {
+            deliver("Name already taken. Try another: ");
+        }
+    }
+
+    // Claims the name in the registry; false if it is taken here or on
+    // another node, or is new and the name table is full.
+    bool sign_in(string_view name) {
+        SymbolId id = user_names.intern(name, config.max_names);
+        if (!id) return false;
+        bool claimed = user_registry.with(id, [&](UserRegistry::Users& by_id) {
+            if (by_id.find(id) || (cluster && cluster->has_user(id))) return false;
+            name_ = name;
+            user_id_ = id;
+            has_name_ = true;
+            online_ = true;
+            by_id.insert_or_assign(id, shared_from_this());
+            user_listing.insert(user_names.name(id));
+            return true;
+        });
+        if (!claimed) return false;
+        char name_len = char(min<size_t>(name_.size(), 255));
+        binary_sender_ = make_shared_string({string_view(&name_len, 1), string_view(name_).substr(0, 255)});
+        colored_name_ = color_ + name_ + reset_color;
+        pv_prefix_ = make_shared_string({colored_name_, " (PV): "});
+        pv_prefix_plain_ = make_shared_string({name_, " (PV): "});
+        if (protocol_ == Protocol::Binary) ++binary_sessions;
+        return true;
+    }
+
+    // Hands over everything that arrived while offline as one write.
+    void drain_mailbox() {
+        FrameString box = mailbox.take(user_id_);
+        if (box.empty()) return;
+        FrameString out;
+        size_t count = 0;
+        Mailbox::for_each(box, [&](SymbolId from, string_view text) {
+            const string& sender = user_names.name(from);
+            if (protocol_ == Protocol::Binary) {
+                char head[packet_header_size + 1];
+                head[0] = char(Op::PvMsg);
+                head[1] = 0;
+                put_u32(head + 2, from);
+                size_t name_len = min<size_t>(sender.size(), 255);
+                put_u32(head + 6, uint32_t(1 + name_len + text.size()));
+                head[packet_header_size] = char(name_len);
+                out.append(head, sizeof(head));
+                out.append(sender, 0, name_len);
+            } else {
+                out.append(sender);
+                out.append(" (PV): ");
+            }
+            out.append(text.data(), text.size());
+            if (protocol_ == Protocol::Text) out.append("\n");
+            ++count;
+        });
+        if (protocol_ == Protocol::Text) {
+            out.insert(0, "You have " + to_string(count) + " message(s) from while you were away:\n");
+        }
+        deliver(adopt_frame(std::move(out)), Traffic::Pv);
+    }
+
+    // A server notice about this user, e.g. " joined room x.", colored, plain
+    // and as an Info packet. It is built before the room's shard knows who
+    // will see it, and joins and leaves are rare next to chat.
+    Message notice(string_view what) const {
+        Message m;
+        m.text = make_frame({colored_name_, what, "\n"});
+        m.plain = make_frame({name_, what, "\n"});
+        m.binary = make_packet(Op::Info, user_id_, {name_, what});
+        return m;
+    }
+
+    // Plain chat costs one compare; anything starting with '/' is looked up
+    // in the command table, and unknown "/words" are chat as well.
+    void handle_command_or_message(string_view msg) {
+        if (msg.front() != '/') {
+            send_message(msg);
+            return;
+        }
+        size_t space = msg.find(' ');
+        string_view args = space == string_view::npos ? string_view() : trim(msg.substr(space + 1));
+        auto cmd = find_command(msg.substr(0, space));
+        if (!cmd) {
+            send_message(msg);
+            return;
+        }
+        if (command_specs[size_t(*cmd)].needs_args && args.empty()) {
+            deliver("Usage: " + string(command_specs[size_t(*cmd)].usage) + "\n");
+            return;
+        }
+        switch (*cmd) {
+        case Command::Join: switch_to_room(args); break;
+        case Command::Pv: switch_to_pv(args); break;
+        case Command::Leave:
+            leave_all();
+            deliver("You left all contexts. Mode: none.\n");
+            break;
+        case Command::WhereAmI: report_whereami(); break;
+        case Command::Rooms: list_rooms(args); break;
+        case Command::Users: list_users(args); break;
+        case Command::History: show_history(args); break;
+        case Command::Presence: set_presence(args); break;
+        case Command::Pong: break;   // activity was recorded on read
+        case Command::Stats: report_stats(); break;
+        case Command::Colors: set_colors(args); break;
+        }
+    }
+
+    void show_history(string_view args) {
+        if (mode_ != Mode::Room || !room_) {
+            deliver("Join a room first.\n");
+            return;
+        }
+        if (!room_->log) {
+            deliver(message_log ? "History is not kept for this room.\n"
+                                : "History is not kept on this server (see --log-dir).\n");
+            return;
+        }
+        size_t n = args.empty() ? config.history : min<size_t>(parse_count(args), 1000);
+        auto self = shared_from_this();
+        auto r = room_;
+        Render render = render_;
+        r->run([self, r, n, render] {
+            r->replay_log(n, [&](const Message& m) { self->deliver_logged(m, render); });
+        });
+    }
+
+    // The log keeps only the colored text and the packet of each message.
+    void deliver_logged(const Message& m, Render render) {
+        if (render == Render::Plain) {
+            if (m.text) deliver(strip_ansi(m.text), Traffic::Room);
+        } else {
+            deliver(m, Traffic::Room);
+        }
+    }
+
+    // quiet: rejoining after a handoff; no notice, ack or history replay.
+    void switch_to_room(string_view room, bool quiet = false) {
+        auto found = rooms.find_or_create(room);
+        if (!found) {
+            deliver("This server takes no new room names; join an existing room.\n");
+            return;
+        }
+        leave_all();
+        mode_ = Mode::Room;
+        room_ = std::move(found);
+        seat_ = allocate_shared<RoomSeat>(PoolAllocator<RoomSeat>());
+        seat_->render = render_;
+        seat_->deflate = deflate_;
+        room_prefix_ = make_shared_string({colored_name_, " [", room_->name, "]: "});
+        room_prefix_plain_ = make_shared_string({name_, " [", room_->name, "]: "});
+
+        auto self = shared_from_this();
+        auto r = room_;
+        auto seat = seat_;
+        Message joined = notice(" joined room " + r->name + ".");
+        Frame ack = protocol_ == Protocol::Binary
+            ? make_packet(Op::Joined, r->id, {r->name})
+            : make_frame({"You are now in room ", r->name, ". Type to chat here.\n"});
+        Frame no_history;
+        if (message_log && (!r->log || r->log->failed)) {
+            no_history = protocol_ == Protocol::Binary
+                ? make_packet(Op::Info, 0, {"history is not kept for this room"})
+                : make_frame({"History is not kept for this room.\n"});
+        }
+        r->run([self, r, seat, joined, ack, no_history, quiet] {
+            // Chat held for the tick goes to those already here; a joiner
+            // with a replay gets it from the log tail instead.
+            if (!quiet && r->log && config.history) flush_batch(*r);
+            r->add(self, seat);
+            if (quiet) return;
+            broadcast_room(*r, joined);
+            self->deliver(ack, Traffic::Control);
+            if (no_history) self->deliver(no_history, Traffic::Control);
+            if (r->log && config.history) {
+                Render render = seat->render;
+                r->replay_log(config.history, [&](const Message& m) { self->deliver_logged(m, render); });
+            }
+        });
+    }
+
+    void switch_to_pv(string_view target) {
+        SymbolId id = user_names.find(target);
+        shared_ptr<ChatSession> peer = id ? find_user(id) : nullptr;
+        bool remote = !peer && id && cluster && cluster->has_user(id);
+        if (!peer && !remote && (!id || !config.mailbox_bytes)) {
+            deliver("User not found.\n");
+            return;
+        }
+        if (id == user_id_) {
+            deliver("You cannot start PV with yourself.\n");
+            return;
+        }
+        leave_all();
+        mode_ = Mode::Pv;
+        pv_id_ = id;
+        pv_peer_ = peer;
+        deliver("Private chat with " + string(target) + " started. Type to chat.\n");
+        if (!peer && !remote && id != user_id_) {
+            deliver(string(target) + " is offline; messages will wait in their mailbox.\n");
+        }
+    }
+
+    static shared_ptr<ChatSession> find_user(SymbolId id) { return user_registry.find(id); }
+
+    // The cached peer handle goes stale when the peer disconnects; fall back
+    // to the registry in case the same name has come back on a new session.
+    shared_ptr<ChatSession> pv_peer() {
+        auto peer = pv_peer_.lock();
+        if (!peer || !peer->online_) {
+            peer = find_user(pv_id_);
+            pv_peer_ = peer;
+        }
+        return peer;
+    }
+
+    void leave_all() {
+        if (mode_ == Mode::Room && room_) {
+            leave_room(room_);
+        }
+        mode_ = Mode::None;
+        room_.reset();
+        seat_.reset();
+        pv_id_ = 0;
+        pv_peer_.reset();
+    }
+
+    void leave_room(const shared_ptr<Room>& r) {
+        auto seat = seat_;
+        Message left = notice(" left room " + r->name + ".");
+        r->run([r, seat, left] {
+            r->remove(seat);
+            if (!draining) broadcast_room(*r, left);
+        });
+    }
+
+    void send_message(string_view text) {
+        if (mode_ == Mode::Room && room_) {
+            auto self = shared_from_this();
+            auto r = room_;
+            auto body = framer_.borrow(text);
+            Message msg;
+            render_room_message(*r, msg, room_prefix_, room_prefix_plain_, binary_sender_, body);
+            Frame forward;
+            if (r->remote_count > 0) {
+                forward = make_node_forward(Op::NodeRoomMsg, r->name, binary_sender_, body);
+            }
+            auto seat = seat_;
+            r->run([self, r, seat, msg, forward, body, prefix = room_prefix_, prefix_plain = room_prefix_plain_,
+                    sender = binary_sender_]() mutable {
+                render_room_message(*r, msg, prefix, prefix_plain, sender, body);
+                if (!forward && !r->remote_links.empty()) {
+                    forward = make_node_forward(Op::NodeRoomMsg, r->name, sender, body);
+                }
+                room_fan_out(r, self.get(), seat, msg);
+                if (forward) {
+                    for (auto& l : r->remote_links) l->send(forward);
+                }
+            });
+        } else if (mode_ == Mode::Pv && pv_id_) {
+            send_pv(pv_id_, pv_peer(), text);
+        } else {
+            deliver("You are not in a room or pv. Use /join <room> or /pv <user>\n");
+        }
+    }
+
+    // Adds the renderings of a room message that r's members lack. Off the
+    // room's shard the counts are a guess, which the shard then completes:
+    // a join or /color may have come in between.
+    static void render_room_message(const Room& r, Message& msg, const SharedString& prefix,
+                                    const SharedString& prefix_plain, const SharedString& sender,
+                                    const BodyRef& body) {
+        if (!msg.text && (r.member_count > r.binary_members || r.log)) {
+            msg.text = make_forward({}, prefix, body, "\n");
+        }
+        if (!msg.plain && r.plain_members > 0) msg.plain = make_forward({}, prefix_plain, body, "\n");
+        if (!msg.binary && (r.binary_members > 0 || r.log)) {
+            msg.binary = make_forward_packet(Op::RoomMsg, r.id, sender, body);
+        }
+    }
+
+    // To a local peer if there is one, else to their node, else their mailbox.
+    void send_pv(SymbolId to, const shared_ptr<ChatSession>& peer, string_view text) {
+        if (peer) {
+            Render render = peer->render_;
+            if (render == Render::Binary) {
+                peer->deliver(make_forward_packet(Op::PvMsg, user_id_, binary_sender_, framer_.borrow(text)),
+                              Traffic::Pv);
+            } else {
+                const SharedString& prefix = render == Render::Plain ? pv_prefix_plain_ : pv_prefix_;
+                peer->deliver(make_forward({}, prefix, framer_.borrow(text), "\n"), Traffic::Pv);
+                peer->deliver(make_frame({"You have new message in pv ", name_, "\n"}), Traffic::Pv);
+            }
+        } else if (cluster && cluster->forward_pv(to, binary_sender_, framer_.borrow(text))) {
+            // delivered by the node they are on
+        } else if (config.mailbox_bytes && mailbox.store(to, user_id_, text)) {
+            // they may have signed in (and drained) since the caller looked
+            if (auto t = find_user(to)) {
+                asio::post(t->executor_, [t] { t->drain_mailbox(); });
+            } else {
+                deliver("User is offline; message saved to their mailbox.\n");
+            }
+        } else if (config.mailbox_bytes) {
+            deliver("User is offline and their mailbox is full; message not saved.\n");
+        } else {
+            deliver("User went offline.\n");
+        }
+    }
+
+    void report_whereami() {
+        if (mode_ == Mode::Room) {
+            deliver("You are in room: " + room_->name + "\n");
+        } else if (mode_ == Mode::Pv) {
+            deliver("You are in pv with: " + user_names.name(pv_id_) + "\n");
+        } else {
+            deliver("You are in: none\n");
+        }
+    }
+
+    // "/rooms [after]"; a page starts after the room named last on the one
+    // before it.
+    void list_rooms(string_view after) {
+        Message msg = room_listing.cached(string(after), [&] {
+            bool more = false;
+            string out = "Rooms:\n";
+            string_view last;
+            for (auto name : room_listing.page({}, after, config.list_page, more)) {
+                auto r = rooms.find(name);
+                out += "- ";
+                out += name;
+                out += " (" + to_string(r ? r->member_count.load() : 0) + " users)\n";
+                last = name;
+            }
+            if (more) out += "More: /rooms " + string(last) + "\n";
+            return info_message(out);
+        });
+        deliver(msg, Traffic::Control);
+    }
+
+    // "/users [prefix|*] [after]"; after runs to the end of the line, as
+    // names may hold spaces.
+    void list_users(string_view args) {
+        string_view prefix = args.substr(0, args.find(' '));
+        string_view after = prefix.size() < args.size() ? trim(args.substr(prefix.size())) : "";
+        if (prefix == "*") prefix = {};
+        string key = string(prefix) + '\0' + string(after);
+        Message msg = user_listing.cached(key, [&] {
+            bool more = false;
+            string out = "Users:\n";
+            string_view last;
+            for (auto name : user_listing.page(prefix, after, config.list_page, more)) {
+                out += "- ";
+                out += name;
+                out += "\n";
+                last = name;
+            }
+            if (more) {
+                out += "More: /users " + (prefix.empty() ? string("*") : string(prefix)) + " " +
+                       string(last) + "\n";
+            }
+            return info_message(out);
+        });
+        deliver(msg, Traffic::Control);
+    }
+
+    // A decimal count, capped at one million; 0 if arg isn't a number.
+    static size_t parse_count(string_view arg) {
+        size_t n = 0;
+        for (char c : arg) {
+            if (c < '0' || c > '9') return 0;
+            n = min<size_t>(n * 10 + size_t(c - '0'), 1000000);
+        }
+        return n;
+    }
+
+
+    void set_presence(string_view arg) {
+        if (arg == "on") {
+            presence_on_ = true;
+            presence.subscribe(user_id_, shared_from_this());
+            deliver("Presence updates on.\n");
+        } else if (arg == "off") {
+            presence_on_ = false;
+            presence.unsubscribe(user_id_);
+            deliver("Presence updates off.\n");
+        } else {
+            deliver("Usage: /presence on|off\n");
+        }
+    }
+
+    // Switches this client between colored and plain text; a room seat
+    // follows on the room's shard.
+    void set_colors(string_view arg) {
+        if (protocol_ == Protocol::Binary || (arg != "on" && arg != "off")) {
+            deliver("Usage: /color on|off\n");
+            return;
+        }
+        Render render = arg == "on" ? Render::Ansi : Render::Plain;
+        render_ = render;
+        if (mode_ == Mode::Room && room_) {
+            auto r = room_;
+            auto seat = seat_;
+            r->run([r, seat, render] { r->set_render(seat, render); });
+        }
+        deliver(arg == "on" ? "Colors on.\n" : "Colors off.\n");
+    }
+
+    void report_stats() {
+        auto& bp = backpressure_stats;
+        deliver("Outbound backpressure: dropped_oldest=" + to_string(bp.dropped_oldest) +
+                " dropped_non_pv=" + to_string(bp.dropped_non_pv) +
+                " dropped_bytes=" + to_string(bp.dropped_bytes) +
+                " slow_disconnects=" + to_string(bp.slow_disconnects) + "\n");
+    }
+
+public:
+    // On the room's shard: logs msg and hands it to every member but sender.
+    static void room_fan_out(const shared_ptr<Room>& r, const ChatSession* sender,
+                             const shared_ptr<RoomSeat>& seat, const Message& msg) {
+        uint32_t trace = msg.trace();
+        auto start = trace ? Clock::now() : Clock::time_point{};
+        if (r->batched) {
+            queue_batched(r, seat, msg);
+            trace_span(trace, TraceStage::FanOut, start, Clock::now());
+            return;
+        }
+        if (r->log) r->append_log(msg);
+        Message out = r->has_deflate_members() ? r->deflated(msg) : msg;
+        metrics().fanout_recipients.record(fan_out(*r, sender, out));
+        if (trace) trace_span(trace, TraceStage::FanOut, start, Clock::now());
+    }
+
+    // A PV that another node forwarded; sender_field is the u8-prefixed name.
+    static void deliver_remote_pv(SymbolId target, SymbolId sender, string_view sender_field, string_view text) {
+        auto t = find_user(target);
+        if (!t) {
+            if (config.mailbox_bytes) mailbox.store(target, sender, text);
+            return;
+        }
+        Render render = t->render_;
+        if (render == Render::Binary) {
+            t->deliver(make_packet(Op::PvMsg, sender, {sender_field, text}), Traffic::Pv);
+        } else {
+            const string& name = user_names.name(sender);
+            if (render == Render::Plain) {
+                t->deliver(make_frame({name, " (PV): ", text, "\n"}), Traffic::Pv);
+            } else {
+                t->deliver(make_frame({remote_color(name), name, reset_color, " (PV): ", text, "\n"}), Traffic::Pv);
+            }
+            t->deliver(make_frame({"You have new message in pv ", name, "\n"}), Traffic::Pv);
+        }
+    }
+
+    // On io thread shard, once draining is set: sends the ticks its batched
+    // rooms still hold, so they reach members' outboxes before those close.
+    static void flush_batches(size_t shard) {
+        for (auto& r : rooms.on_shard(shard)) flush_batch(*r);
+    }
+
+private:
+    // Must run on the room's shard.
+    static void broadcast_room(Room& room, const Message& msg) {
+        flush_batch(room);   // keep notices behind the chat already sent
+        Message out = room.has_deflate_members() ? room.deflated(msg) : msg;
+        fan_out(room, nullptr, out);
+    }
+
+    // Renderings for particular members, sorted by session: a batched tick
+    // without the lines they sent themselves.
+    using FanOutOverrides = vector<pair<const ChatSession*, Message>>;
+
+    // On the room's shard: hands out to every member but skip and returns how
+    // many that was. Up to --fanout-inline members (or with one io thread)
+    // this is one loop here. Past that, members on other shards are passed to
+    // their own io thread in chunks of --fanout-chunk, which deliver there
+    // and all share one copy of out; only this shard's members are served
+    // inline, which keeps their order with everything else this thread sends.
+    static size_t fan_out(Room& room, const ChatSession* skip, const Message& out,
+                          shared_ptr<const FanOutOverrides> own = nullptr) {
+        auto pick = [](const ChatSession* s, const Message& out, const FanOutOverrides* own) -> const Message& {
+            if (!own) return out;
+            auto it = lower_bound(own->begin(), own->end(), s,
+                                  [](const auto& e, const ChatSession* p) { return e.first < p; });
+            return it != own->end() && it->first == s ? it->second : out;
+        };
+        size_t recipients = room.members.size();
+        if (io_pool->size() == 1 || room.members.size() <= config.fanout_inline) {
+            for (auto& s : room.members) {
+                if (s.get() == skip) {
+                    --recipients;
+                    continue;
+                }
+                s->deliver(pick(s.get(), out, own.get()), Traffic::Room);
+            }
+            return recipients;
+        }
+
+        if (room.by_shard.empty()) {
+            vector<Room::Partition> parts(io_pool->size());
+            for (auto& s : room.members) parts[s->shard_].push_back(s);
+            for (auto& p : parts) room.by_shard.push_back(make_shared<const Room::Partition>(std::move(p)));
+        }
+        auto shared = make_shared<const Message>(out);
+        for (size_t shard = 0; shard < room.by_shard.size(); ++shard) {
+            const auto& part = room.by_shard[shard];
+            if (shard == room.shard || part->empty()) continue;
+            for (size_t from = 0; from < part->size(); from += config.fanout_chunk) {
+                size_t to = min(part->size(), from + config.fanout_chunk);
+                shard_mesh->run(shard, [part, from, to, skip, shared, own, pick] {
+                    for (size_t i = from; i < to; ++i) {
+                        ChatSession* s = (*part)[i].get();
+                        if (s != skip) s->deliver(pick(s, *shared, own.get()), Traffic::Room);
+                    }
+                });
+            }
+        }
+        for (auto& s : *room.by_shard[room.shard]) {
+            if (s.get() != skip) s->deliver(pick(s.get(), out, own.get()), Traffic::Room);
+        }
+        // skip may have left already; it can only be in its own shard's part
+        if (skip && skip->shard_ < room.by_shard.size()) {
+            const auto& part = *room.by_shard[skip->shard_];
+            if (any_of(part.begin(), part.end(), [skip](const auto& s) { return s.get() == skip; })) --recipients;
+        }
+        return recipients;
+    }
+
+    // Batched rooms, on the room's shard: hold msg until the tick ends.
+    static void queue_batched(const shared_ptr<Room>& r, const shared_ptr<RoomSeat>& sender,
+                              const Message& msg) {
+        const Frame& f = msg.text ? msg.text : msg.binary;
+        if (!f) return;
+        sender->sent_in_batch = r->batch_gen;
+        r->batch.push_back({sender, msg});
+        r->batch_bytes += f->size();
+        if (r->batch_bytes >= config.batch_bytes || draining) {
+            flush_batch(*r);
+        } else if (!r->batch_armed) {
+            r->batch_armed = true;
+            r->batch_timer.expires_after(chrono::milliseconds(config.batch_ms));
+            r->batch_timer.async_wait([r](asio::error_code ec) {
+                if (ec == asio::error::operation_aborted) return;
+                r->batch_armed = false;
+                flush_batch(*r);
+            });
+        }
+    }
+
+    static void flush_batch(Room& room) {
+        if (room.batch.empty()) return;
+        if (room.batch_armed) {
+            room.batch_armed = false;
+            room.batch_timer.cancel();
+        }
+        vector<Room::BatchEntry> batch;
+        batch.swap(room.batch);
+        room.batch_bytes = 0;
+        uint64_t gen = room.batch_gen++;
+        // Logged as they go out, so a replay never repeats a held message.
+        if (room.log) {
+            for (auto& e : batch) room.append_log(e.msg);
+        }
+        const Message& first = batch.front().msg;
+        DispatchScope scope((first.text ? first.text : first.binary)->origin);
+
+        // Rendered tick for everyone, or for everyone but one sender.
+        bool with_plain = room.plain_members > 0;
+        auto render = [&](const RoomSeat* skip) {
+            FrameString text, plain, binary;
+            for (auto& e : batch) {
+                if (e.sender.get() == skip) continue;
+                if (e.msg.text) e.msg.text->append_to(text);
+                if (with_plain) {
+                    if (auto& f = e.msg.plain ? e.msg.plain : e.msg.text) f->append_to(plain);
+                }
+                if (e.msg.binary) e.msg.binary->append_to(binary);
+            }
+            Message out;
+            if (!text.empty()) out.text = adopt_frame(std::move(text));
+            if (!plain.empty()) out.plain = adopt_frame(std::move(plain));
+            if (!binary.empty()) out.binary = adopt_frame(std::move(binary));
+            return out;
+        };
+
+        Message all = render(nullptr);
+        if (room.has_deflate_members()) all = room.deflated(all);
+        auto own = make_shared<FanOutOverrides>();
+        for (size_t i = 0; i < room.members.size(); ++i) {
+            const auto& seat = room.seats[i];
+            if (seat->sent_in_batch == gen) own->emplace_back(room.members[i].get(), render(seat.get()));
+        }
+        sort(own->begin(), own->end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        metrics().fanout_recipients.record(fan_out(room, nullptr, all, own->empty() ? nullptr : std::move(own)));
+    }
+
+    void close() {
+        cleanup();
+        asio::error_code ignored;
+        socket_.close(ignored);
+    }
+
+    // Stops reading but lets already queued output (e.g. an Error packet)
+    // reach the client before the socket goes away.
+    void close_after_flush() {
+        closing_ = true;
+        if (!writing_) close();
+    }
+
+    // The end of freeze(): everything the next process needs, and the socket.
+    // cleanup() never runs, so to everyone else this user never left.
+    void hand_off() {
+        HandoffState st;
+        st.name = name_;
+        st.protocol = protocol_;
+        st.render = render_;
+        st.negotiated = negotiated_;
+        st.presence = presence_on_;
+        st.deflate = deflate_;
+        st.mode = mode_;
+        if (mode_ == Mode::Room && room_) st.room = room_->name;
+        if (mode_ == Mode::Pv) st.pv = user_names.name(pv_id_);
+        st.input = string(framer_.pending());
+        asio::error_code ec;
+        auto fd = socket_.release(ec);
+        if (!ec) st.fd = int(fd);
+        closed_ = true;
+#ifdef CHAT_COROUTINES
+        wake_.cancel();
+#endif
+        if (pause_timer_) pause_timer_->cancel();
+        handoff_report(std::move(st));
+    }
+
+    // The next deadline among handshake, idle and ping, if any applies.
+    void schedule_timeout() {
+        uint64_t next = UINT64_MAX;
+        if (!has_name_ && config.handshake_secs) next = min(next, accepted_tick_ + config.handshake_secs);
+        if (config.idle_secs) next = min(next, last_input_tick_ + config.idle_secs);
+        if (config.ping_secs) next = min(next, max(last_input_tick_, last_ping_tick_) + config.ping_secs);
+        if (next != UINT64_MAX) wheel_->schedule(weak_from_this(), next);
+    }
+
+    void time_out(const string& why) {
+        deliver(why);
+        close_after_flush();
+        if (!closed_) wheel_->schedule(weak_from_this(), wheel_->now() + 1);
+    }
+
+    void cleanup() {
+        if (closed_) return;
+        closed_ = true;
+        online_ = false;
+        if (frozen_) handoff_report({});   // lost while it was flushing
+        metrics().disconnects.add();
+        metrics().queued_frames.add(-int64_t(outbox_.size()));
+        int64_t bytes = 0;
+        for (auto& o : outbox_) bytes += int64_t(o.frame->size());
+        metrics().queued_bytes.add(-bytes);
+        outbox_.clear();
+        queued_bytes_ = 0;
+#ifdef CHAT_COROUTINES
+        wake_.cancel();
+#endif
+        if (pause_timer_) pause_timer_->cancel();
+        {
+            lock_guard<mutex> lock(sessions_mutex);
+            sessions.erase(shared_from_this());
+        }
+        if (user_id_) {
+            user_registry.with(user_id_, [&](UserRegistry::Users& by_id) {
+                auto* s = by_id.find(user_id_);
+                if (!s || s->get() != this) return;
+                by_id.erase(user_id_);
+                user_listing.erase(user_names.name(user_id_));
+                // While the name is still ours: a quick reconnect under it
+                // must not have its subscription or online notice undone.
+                presence.unsubscribe(user_id_);
+                if (cluster) cluster->user_offline(name_);
+            });
+        }
+        if (mode_ == Mode::Room && room_) {
+            leave_room(room_);
+        }
+        mode_ = Mode::None;
+        room_.reset();
+        seat_.reset();
+        pv_id_ = 0;
+        pv_peer_.reset();
+        if (has_name_) {
+            if (protocol_ == Protocol::Binary) --binary_sessions;
+            presence.left(user_id_);
+        }
+    }
+
+    static string_view trim(string_view s) {
+        auto is_space = [](char ch){ return std::isspace(static_cast<unsigned char>(ch)) != 0; };
+        while (!s.empty() && is_space(s.front())) s.remove_prefix(1);
+        while (!s.empty() && is_space(s.back())) s.remove_suffix(1);
+        return s;
+    }
+
+    // Trimmed input, or nullopt if what is left holds a control byte: a CR,
+    // LF or escape sequence inside a name or text would let one user forge
+    // lines or colors on other users' screens. Tabs are let through.
+    static optional<string_view> clean_input(string_view s) {
+        s = trim(s);
+        for (unsigned char ch : s) {
+            if ((ch < 0x20 && ch != '\t') || ch == 0x7f) return nullopt;
+        }
+        return s;
+    }
+
+    // ======= Fields =======
+    asio::io_context::executor_type executor_;
+    const size_t shard_;
+    tcp::socket socket_;
+#ifdef CHAT_COROUTINES
+    asio::steady_timer wake_;   // the writer's doorbell
+#endif
+
+    // timeouts, in wheel ticks (seconds); wheel_ is null when all are off
+    TimingWheel<ChatSession>* wheel_;
+    uint64_t accepted_tick_ = 0;
+    uint64_t last_input_tick_ = 0;
+    uint64_t last_ping_tick_ = 0;
+
+    RateLimiter limiter_{config.user_rate, config.user_burst};
+    optional<asio::steady_timer> pause_timer_;   // made on first throttle
+
+    InputFramer framer_;
+#ifndef CHAT_COROUTINES
+    HandlerMemory read_mem_;
+    HandlerMemory write_mem_;
+#endif
+
+    // outbound
+    deque<Outgoing> outbox_;
+    deque<Outgoing> inflight_;
+    vector<asio::const_buffer> write_bufs_;
+    size_t queued_bytes_ = 0;   // footprint of outbox_, not counting the write in flight
+    Clock::time_point write_started_;   // kept only while tracing
+    std::optional<chrono::steady_clock::time_point> over_since_;
+    bool writing_;
+
+    // identity
+    string name_;
+    SymbolId user_id_ = 0;
+    atomic<bool> online_{false};   // read by other sessions' PV lookups
+    string color_;
+    string colored_name_;          // color_ + name_ + reset, fixed at sign-in
+    atomic<Render> render_{config.colors ? Render::Ansi : Render::Plain};   // read by PV senders
+    atomic<bool> deflate_{false};  // output goes out as deflate records; set once, on negotiation
+    bool has_name_;
+    bool closed_;
+    bool closing_ = false;
+    bool frozen_ = false;          // handing off: input is kept, not acted on
+    bool presence_on_ = true;
+    Protocol protocol_ = Protocol::Text;
+    bool negotiated_ = false;
+    SharedString binary_sender_;   // u8 length + name, the RoomMsg/PvMsg payload prefix
+    SharedString pv_prefix_;       // "name (PV): " as shown to text clients
+    SharedString pv_prefix_plain_;
+
+    // context
+    Mode mode_;
+    shared_ptr<Room> room_;
+    shared_ptr<RoomSeat> seat_;
+    SharedString room_prefix_;     // "name [room]: " while in a room
+    SharedString room_prefix_plain_;
+    SymbolId pv_id_ = 0;
+    weak_ptr<ChatSession> pv_peer_;
+};
+
+// ======= Cluster links =======
+void ClusterLink::start() {
+    asio::post(executor_, [self = shared_from_this()] {
+        self->socket_.set_option(tcp::no_delay(true));
+        cluster->link_up(self);
+        self->do_read();
+    });
+}
+
+void ClusterLink::on_packet(const PacketHeader& header, string_view payload) {
+    metrics().frames_in.add();
+    cluster->handle(shared_from_this(), header, payload);
+}
+
+void ClusterLink::close() {
+    if (closed_) return;
+    closed_ = true;
+    outbox_.clear();
+    asio::error_code ignored;
+    socket_.close(ignored);
+    cluster->link_down(shared_from_this());
+}
+
+void Cluster::start() {
+    auto colon = self_.rfind(':');
+    if (colon == string::npos) throw runtime_error("--cluster wants host:port, got " + self_);
+    auto port = static_cast<unsigned short>(stoul(self_.substr(colon + 1)));
+    acceptor_ = make_unique<tcp::acceptor>(io_pool->at(0), tcp::endpoint(tcp::v4(), port));
+    accept();
+    for (auto& peer : peers_) {
+        if (peer > self_) dial(peer);
+    }
+}
+
+void Cluster::accept() {
+    asio::io_context& io = io_pool->next();
+    acceptor_->async_accept(io, [this, &io](std::error_code ec, tcp::socket socket) {
+        if (!ec) make_shared<ClusterLink>(io, std::move(socket), "", false)->start();
+        accept();
+    });
+}
+
+void Cluster::dial(const string& peer) {
+    auto colon = peer.rfind(':');
+    if (colon == string::npos) throw runtime_error("--peer wants host:port, got " + peer);
+    asio::io_context& io = io_pool->next();
+    auto resolver = make_shared<tcp::resolver>(io);
+    auto socket = make_shared<tcp::socket>(io);
+    resolver->async_resolve(peer.substr(0, colon), peer.substr(colon + 1),
+        [this, peer, resolver, socket, &io](std::error_code ec, tcp::resolver::results_type endpoints) {
+            if (ec) {
+                redial(peer);
+                return;
+            }
+            asio::async_connect(*socket, endpoints,
+                [this, peer, socket, &io](std::error_code ec, const tcp::endpoint&) {
+                    if (ec) {
+                        redial(peer);
+                        return;
+                    }
+                    make_shared<ClusterLink>(io, std::move(*socket), peer, true)->start();
+                });
+        });
+}
+
+void Cluster::redial(const string& peer) {
+    auto timer = make_shared<asio::steady_timer>(io_pool->at(0), chrono::seconds(1));
+    timer->async_wait([this, peer, timer](asio::error_code) { dial(peer); });
+}
+
+// Introduces this node and replays its local rooms and users to the peer.
+void Cluster::link_up(const shared_ptr<ClusterLink>& link) {
+    {
+        lock_guard<mutex> lock(m_);
+        links_.push_back(link);
+    }
+    link->send(make_node_packet(Op::NodeHello, 0, self_));
+    for (auto& r : rooms.occupied()) link->send(make_node_packet(Op::NodeRoom, 1, r));
+    for (SymbolId id : user_registry.ids()) link->send(make_node_packet(Op::NodeUser, 1, user_names.name(id)));
+}
+
+void Cluster::link_down(const shared_ptr<ClusterLink>& link) {
+    vector<SymbolId> gone;
+    {
+        lock_guard<mutex> lock(m_);
+        links_.erase(remove(links_.begin(), links_.end(), link), links_.end());
+        remote_users_.for_each([&](SymbolId id, shared_ptr<ClusterLink>& l) {
+            if (l == link) gone.push_back(id);
+        });
+        for (SymbolId id : gone) remote_users_.erase(id);
+    }
+    for (SymbolId id : gone) {
+        user_listing.erase(user_names.name(id));
+        presence.left(id);
+    }
+    link->rooms.for_each([&](RoomId id, char&) {
+        if (auto r = rooms.find(id)) {
+            r->run([r, link] { r->remove_remote(link); });
+        }
+    });
+    cout << "Cluster link to " << link->peer() << " down\n";
+    if (link->dialed()) redial(link->peer());
+}
+
+void Cluster::handle(const shared_ptr<ClusterLink>& link, const PacketHeader& header, string_view payload) {
+    string_view a;
+    if (!take_str(payload, a)) return;
+    switch (header.op) {
+    case Op::NodeHello:
+        if (!link->dialed()) link->set_peer(a);
+        cout << "Cluster link to " << a << " up\n";
+        break;
+    case Op::NodeRoom: {
+        auto r = rooms.find_or_create(a);
+        if (!r) return;
+        bool known = link->rooms.find(r->id) != nullptr;
+        if (header.flags && !known) {
+            link->rooms.insert_or_assign(r->id, 1);
+            r->run([r, link] { r->add_remote(link); });
+        } else if (!header.flags && known) {
+            link->rooms.erase(r->id);
+            r->run([r, link] { r->remove_remote(link); });
+        }
+        break;
+    }
+    case Op::NodeUser: {
+        SymbolId id = user_names.intern(a, config.max_names);
+        if (!id) return;
+        lock_guard<mutex> lock(m_);
+        if (header.flags) {
+            remote_users_.insert_or_assign(id, link);
+            user_listing.insert(user_names.name(id));
+            presence.joined(id);
+        } else if (auto* l = remote_users_.find(id); l && *l == link) {
+            remote_users_.erase(id);
+            user_listing.erase(user_names.name(id));
+            presence.left(id);
+        }
+        break;
+    }
+    case Op::NodeRoomMsg: {
+        // payload now: str(sender) text
+        auto r = rooms.find(a);
+        string_view sender_field = payload.substr(0, payload.empty() ? 0 : 1 + size_t(uint8_t(payload[0])));
+        string_view sender;
+        if (!r || !take_str(payload, sender)) return;
+        // Rendered on the room's shard, where its member counts are exact.
+        r->run([r, field = string(sender_field), text = string(payload)] {
+            string_view sender = string_view(field).substr(1);
+            Message msg;
+            if (r->member_count > r->binary_members || r->log) {
+                msg.text = make_frame({remote_color(sender), sender, reset_color, " [", r->name, "]: ", text, "\n"});
+            }
+            if (r->plain_members > 0) msg.plain = make_frame({sender, " [", r->name, "]: ", text, "\n"});
+            if (r->binary_members > 0 || r->log) msg.binary = make_packet(Op::RoomMsg, r->id, {field, text});
+            ChatSession::room_fan_out(r, nullptr, r->remote_seat, msg);
+        });
+        break;
+    }
+    case Op::NodePv: {
+        string_view sender_field = payload.substr(0, payload.empty() ? 0 : 1 + size_t(uint8_t(payload[0])));
+        string_view sender;
+        SymbolId to = user_names.find(a);
+        SymbolId from = take_str(payload, sender) ? user_names.intern(sender, config.max_names) : 0;
+        if (!to || !from) return;
+        ChatSession::deliver_remote_pv(to, from, sender_field, payload);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// ======= Shard tasks =======
+void ShardMesh::execute(ShardTask& task) {
+    if (task.run) {
+        task.run();
+    } else {
+        task.session->deliver(std::move(task.frame), task.traffic);
+    }
+}
+
+// ======= Presence digest =======
+void Presence::flush() {
+    if (draining) return;
+    vector<SymbolId> joins, leaves;
+    for (auto& shard : shards_) {
+        FlatMap<int> changes;
+        {
+            lock_guard<mutex> lock(shard.m);
+            if (shard.changes.size() == 0) continue;
+            swap(changes, shard.changes);
+        }
+        changes.for_each([&](SymbolId user, int delta) {
+            (delta > 0 ? joins : leaves).push_back(user);
+        });
+    }
+    if (joins.empty() && leaves.empty()) return;
+
+    string text = "Presence:";
+    auto list = [&](const char* what, vector<SymbolId>& users) {
+        if (users.empty()) return;
+        vector<string_view> names;
+        for (SymbolId id : users) names.push_back(user_names.name(id));
+        sort(names.begin(), names.end());
+        text += text.size() > 9 ? "; " : " ";
+        text += what;
+        for (size_t i = 0; i < names.size() && i < config.presence_names; ++i) {
+            text += i ? ", " : " ";
+            text += names[i];
+        }
+        if (names.size() > config.presence_names) {
+            text += " (+" + to_string(names.size() - config.presence_names) + " more)";
+        }
+    };
+    list("joined", joins);
+    list("left", leaves);
+
+    Message msg;
+    msg.text = make_frame({text, ".\n"});
+    if (binary_sessions > 0) msg.binary = make_packet(Op::Info, 0, {text, "."});
+
+    vector<shared_ptr<ChatSession>> targets;
+    for (auto& shard : shards_) {
+        lock_guard<mutex> lock(shard.m);
+        shard.subscribers.for_each([&](SymbolId, shared_ptr<ChatSession>& s) { targets.push_back(s); });
+    }
+    metrics().fanout_recipients.record(targets.size());
+    for (auto& s : targets) s->deliver(msg, Traffic::Broadcast);
+}
+
+// On Linux every io thread gets its own SO_REUSEPORT listener and the kernel
+// spreads new connections over them, so accepting scales with the pool.
+// Elsewhere one listener hands sockets round-robin to the contexts.
+#if defined(__linux__) && defined(SO_REUSEPORT)
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+constexpr bool per_thread_listeners = true;
+#else
+constexpr bool per_thread_listeners = false;
+#endif
+
+class ChatServer {
+public:
+    // Listens on port, or carries on with the listeners a handoff passed in.
+    ChatServer(unsigned short port, const vector<int>& inherited) {
+        size_t n = !inherited.empty() ? inherited.size() : per_thread_listeners ? io_pool->size() : 1;
+        tcp::endpoint endpoint(tcp::v4(), port);
+#if defined(__linux__) && defined(SO_REUSEPORT)
+        if (inherited.empty() && n > 1) ensure_port_free(endpoint);
+#endif
+        for (size_t i = 0; i < n; ++i) {
+            auto l = make_unique<Listener>(io_pool->at(i), i % io_pool->size(), n < io_pool->size());
+            if (!inherited.empty()) {
+                l->acceptor.assign(tcp::v4(), inherited[i]);
+            } else {
+                l->acceptor.open(endpoint.protocol());
+                l->acceptor.set_option(tcp::acceptor::reuse_address(true));
+#if defined(__linux__) && defined(SO_REUSEPORT)
+                if (n > 1) l->acceptor.set_option(reuse_port(true));
+#endif
+                l->acceptor.bind(endpoint);
+                l->acceptor.listen(config.backlog);
+            }
+            l->acceptor.non_blocking(true);
+            listeners_.push_back(std::move(l));
+        }
+        for (auto& l : listeners_) do_accept(*l);
+    }
+
+    // Stops accepting on the listeners of io context i; must run on its
+    // thread. With keep their fds are released for a handoff, not closed.
+    vector<int> stop_listening(size_t i, bool keep) {
+        vector<int> fds;
+        for (auto& l : listeners_) {
+            if (l->index != i || !l->acceptor.is_open()) continue;
+            l->retry.cancel();
+            asio::error_code ec;
+            if (keep) {
+                auto fd = l->acceptor.release(ec);
+                if (!ec) fds.push_back(int(fd));
+            } else {
+                l->acceptor.close(ec);
+            }
+        }
+        return fds;
+    }
+
+    // Sessions a handoff passed in, spread over the contexts like new ones.
+    void adopt(vector<HandoffState> states) {
+        for (auto& st : states) {
+            size_t i = io_pool->next_index();
+            tcp::socket socket(io_pool->at(i));
+            asio::error_code ec;
+            socket.assign(tcp::v4(), st.fd, ec);
+            if (ec) continue;
+            auto* wheel = wheels.empty() ? nullptr : wheels[i].get();
+            allocate_shared<ChatSession>(PoolAllocator<ChatSession>(), io_pool->at(i), i, std::move(socket), wheel)
+                ->resume(std::move(st));
+        }
+    }
+
+private:
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    // SO_REUSEPORT would let the listeners join another instance already
+    // on the port and quietly take half its connections. A plain bind
+    // fails if anything listens there, so try one first.
+    static void ensure_port_free(const tcp::endpoint& endpoint) {
+        tcp::acceptor probe(io_pool->at(0));
+        probe.open(endpoint.protocol());
+        probe.set_option(tcp::acceptor::reuse_address(true));
+        asio::error_code ec;
+        probe.bind(endpoint, ec);
+        if (ec == asio::error::address_in_use)
+            throw runtime_error("port " + to_string(endpoint.port()) + " is already in use");
+        if (ec) throw asio::system_error(ec);
+    }
+#endif
+
+    struct Listener {
+        Listener(asio::io_context& io, size_t index, bool spread)
+            : acceptor(io), retry(io), index(index), spread(spread) {}
+
+        size_t next_context() { return spread ? io_pool->next_index() : index; }
+
+        tcp::acceptor acceptor;
+        asio::steady_timer retry;   // backs off when accept fails, e.g. out of fds
+        size_t index;
+        bool spread;
+    };
+
+    // Upper bound on connections taken per wakeup; keeps a reconnect storm
+    // from starving the sessions already on this thread.
+    static constexpr int accept_batch = 64;
+
+    void do_accept(Listener& l) {
+        if (!l.acceptor.is_open()) return;
+        size_t i = l.next_context();
+        l.acceptor.async_accept(
+            io_pool->at(i),
+            [this, &l, i](asio::error_code ec, tcp::socket socket) {
+                if (ec == asio::error::operation_aborted) return;
+                if (ec) {
+                    l.retry.expires_after(chrono::milliseconds(100));
+                    l.retry.async_wait([this, &l](asio::error_code ec) {
+                        if (!ec) do_accept(l);
+                    });
+                    return;
+                }
+                start_session(i, std::move(socket));
+                drain(l);
+                do_accept(l);
+            }
+        );
+    }
+
+    // A wakeup during a storm usually finds more connections queued; take
+    // them with non-blocking accepts instead of one trip through the
+    // reactor each.
+    void drain(Listener& l) {
+        for (int n = 1; n < accept_batch; ++n) {
+            size_t i = l.next_context();
+            asio::error_code ec;
+            tcp::socket socket = l.acceptor.accept(io_pool->at(i), ec);
+            if (ec) break;
+            start_session(i, std::move(socket));
+        }
+    }
+
+    void start_session(size_t i, tcp::socket socket) {
+        metrics().accepts.add();
+        asio::error_code ignored;
+        socket.set_option(tcp::no_delay(true), ignored);
+        if (config.sndbuf) socket.set_option(asio::socket_base::send_buffer_size(int(config.sndbuf)), ignored);
+        if (config.rcvbuf) socket.set_option(asio::socket_base::receive_buffer_size(int(config.rcvbuf)), ignored);
+        auto* wheel = wheels.empty() ? nullptr : wheels[i].get();
+        allocate_shared<ChatSession>(PoolAllocator<ChatSession>(), io_pool->at(i), i, std::move(socket), wheel)->start();
+    }
+
+    vector<unique_ptr<Listener>> listeners_;
+};
+
+// ======= Admin endpoint =======
+// Renders every metric in the Prometheus text exposition format.
+string render_metrics() {
+    uint64_t accepts = 0, disconnects = 0, frames_in = 0, throttled = 0, bytes_written = 0;
+    uint64_t deflate_in = 0, deflate_out = 0;
+    int64_t queued_frames = 0, queued_bytes = 0;
+    vector<uint64_t> fanout, latency;
+    uint64_t fanout_sum = 0, latency_sum = 0;
+    {
+        lock_guard<mutex> lock(metrics_mutex);
+        for (auto* m : all_metrics) {
+            accepts += m->accepts.get();
+            disconnects += m->disconnects.get();
+            frames_in += m->frames_in.get();
+            throttled += m->throttled.get();
+            bytes_written += m->bytes_written.get();
+            deflate_in += m->deflate_in.get();
+            deflate_out += m->deflate_out.get();
+            queued_frames += m->queued_frames.get();
+            queued_bytes += m->queued_bytes.get();
+            m->fanout_recipients.merge_into(fanout, fanout_sum);
+            m->read_to_deliver_us.merge_into(latency, latency_sum);
+        }
+    }
+
+    ostringstream out;
+    auto counter = [&](const char* name, const char* help, uint64_t v) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n"
+            << name << " " << v << "\n";
+    };
+    auto gauge = [&](const char* name, const char* help, int64_t v) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n"
+            << name << " " << v << "\n";
+    };
+    // Buckets are emitted only at power-of-two edges, up to the first one that
+    // holds every sample; scale converts the recorded unit into the exported one.
+    auto histogram = [&](const char* name, const char* help, const vector<uint64_t>& counts,
+                         uint64_t sum, double scale) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+        uint64_t total = 0;
+        for (auto c : counts) total += c;
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            cumulative += counts[i];
+            uint64_t upper = Histogram::upper_bound(i);
+            if ((upper & (upper - 1)) != 0) continue;
+            out << name << "_bucket{le=\"" << double(upper) * scale << "\"} " << cumulative << "\n";
+            if (cumulative == total) break;
+        }
+        out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+            << name << "_sum " << double(sum) * scale << "\n"
+            << name << "_count " << cumulative << "\n";
+    };
+
+    counter("chat_accepts_total", "Accepted client connections.", accepts);
+    counter("chat_disconnects_total", "Closed client sessions.", disconnects);
+    counter("chat_frames_in_total", "Inbound lines dispatched.", frames_in);
+    counter("chat_throttled_total", "Read pauses due to rate limits.", throttled);
+    counter("chat_bytes_written_total", "Bytes written to client sockets.", bytes_written);
+    counter("chat_deflate_in_bytes_total", "Outbound bytes deflated for clients that asked.", deflate_in);
+    counter("chat_deflate_out_bytes_total", "What those bytes deflated to.", deflate_out);
+    gauge("chat_outbound_queue_frames", "Outbound frames queued or in flight.", queued_frames);
+    gauge("chat_outbound_queue_bytes", "Outbound bytes queued or in flight.", queued_bytes);
+
+    auto& bp = backpressure_stats;
+    out << "# HELP chat_backpressure_drops_total Frames shed from slow consumers, by policy.\n"
+        << "# TYPE chat_backpressure_drops_total counter\n"
+        << "chat_backpressure_drops_total{policy=\"drop-oldest\"} " << bp.dropped_oldest << "\n"
+        << "chat_backpressure_drops_total{policy=\"drop-non-pv\"} " << bp.dropped_non_pv << "\n";
+    counter("chat_backpressure_dropped_bytes_total", "Bytes shed from slow consumers.", bp.dropped_bytes);
+    counter("chat_backpressure_disconnects_total", "Slow consumers disconnected.", bp.slow_disconnects);
+    gauge("chat_mailbox_bytes", "PV bytes held for offline users.", int64_t(mailbox.bytes()));
+
+    histogram("chat_fanout_recipients", "Recipients per fan-out.", fanout, fanout_sum, 1.0);
+    histogram("chat_read_to_deliver_seconds", "Time from inbound read to recipient write completion.",
+              latency, latency_sum, 1e-6);
+    return out.str();
+}
+
+// Dumps the trace rings as Chrome trace events: one complete ("X") event per
+// span, and a flow ("s", "t", "f") tying together the spans of each line.
+string render_trace() {
+    vector<TraceEvent> events;
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        for (auto* r : all_traces) r->for_each([&](const TraceEvent& e) { events.push_back(e); });
+    }
+    sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+        return a.trace != b.trace ? a.trace < b.trace : a.start_ns < b.start_ns;
+    });
+
+    ostringstream out;
+    out << fixed << setprecision(3) << "{\"traceEvents\":[";
+    const char* sep = "\n";
+    for (size_t i = 0; i < events.size(); ++i) {
+        auto& e = events[i];
+        double ts = double(e.start_ns) / 1000, dur = double(max<int64_t>(0, e.dur_ns)) / 1000;
+        out << sep << "{\"name\":\"" << trace_stage_names[size_t(e.stage)]
+            << "\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":" << ts << ",\"dur\":" << dur
+            << ",\"pid\":1,\"tid\":" << e.thread << ",\"args\":{\"trace\":" << e.trace << "}}";
+        sep = ",\n";
+        bool first = i == 0 || events[i - 1].trace != e.trace;
+        bool last = i + 1 == events.size() || events[i + 1].trace != e.trace;
+        if (first && last) continue;
+        out << sep << "{\"name\":\"line\",\"cat\":\"chat\",\"ph\":\"" << (first ? "s" : last ? "f" : "t")
+            << "\",\"id\":" << e.trace << ",\"ts\":" << ts << ",\"pid\":1,\"tid\":" << e.thread
+            << (last ? ",\"bp\":\"e\"" : "") << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return out.str();
+}
+
+// Minimal HTTP/1.0-style server: one request per connection, then close.
+class AdminConnection : public enable_shared_from_this<AdminConnection> {
+public:
+    explicit AdminConnection(tcp::socket socket)
+        : socket_(std::move(socket)), request_(8192) {}
+
+    void start() {
+        auto self = shared_from_this();
+        asio::async_read_until(socket_, request_, "\r\n\r\n",
+            [this, self](std::error_code ec, size_t) {
+                if (ec) return;
+                istream in(&request_);
+                string method, path;
+                in >> method >> path;
+                respond(path);
+            });
+    }
+
+private:
+    void respond(const string& path) {
+        string status = "200 OK", type = "text/plain; version=0.0.4", body;
+        if (path == "/metrics") {
+            body = render_metrics();
+        } else if (path == "/trace") {
+            type = "application/json";
+            body = render_trace();
+        } else {
+            status = "404 Not Found";
+            body = "not found\n";
+        }
+        response_ = "HTTP/1.1 " + status + "\r\n"
+                    "Content-Type: " + type + "\r\n"
+                    "Content-Length: " + to_string(body.size()) + "\r\n"
+                    "Connection: close\r\n\r\n" + body;
+        auto self = shared_from_this();
+        asio::async_write(socket_, asio::buffer(response_),
+            [this, self](std::error_code, size_t) {
+                asio::error_code ignored;
+                socket_.shutdown(tcp::socket::shutdown_both, ignored);
+            });
+    }
+
+    tcp::socket socket_;
+    asio::streambuf request_;
+    string response_;
+};
+
+class AdminServer {
+public:
+    AdminServer(asio::io_context& io, unsigned short port)
+        : acceptor_(io, tcp::endpoint(tcp::v4(), port)) {
+        do_accept();
+    }
+
+private:
+    void do_accept() {
+        acceptor_.async_accept([this](std::error_code ec, tcp::socket socket) {
+            if (!ec) make_shared<AdminConnection>(std::move(socket))->start();
+            do_accept();
+        });
+    }
+
+    tcp::acceptor acceptor_;
+};
+
+// ======= Restart =======
+// Runs f(i) on every io thread, then done on thread 0. Anything posted to a
+// context before f was posted there has run by the time done does.
+void on_every_context(function<void(size_t)> f, function<void()> done) {
+    auto left = make_shared<atomic<size_t>>(io_pool->size());
+    for (size_t i = 0; i < io_pool->size(); ++i) {
+        asio::post(io_pool->at(i), [f, done, left, i] {
+            f(i);
+            if (--*left == 0) asio::post(io_pool->at(0), done);
+        });
+    }
+}
+
+vector<shared_ptr<ChatSession>> all_sessions() {
+    lock_guard<mutex> lock(sessions_mutex);
+    return vector<shared_ptr<ChatSession>>(sessions.begin(), sessions.end());
+}
+
+// Exits once every session has closed, or at the deadline.
+void wait_for_sessions(shared_ptr<asio::steady_timer> timer, Clock::time_point deadline) {
+    if (all_sessions().empty() || Clock::now() >= deadline) {
+        io_pool->stop();
+        return;
+    }
+    timer->expires_after(chrono::milliseconds(50));
+    timer->async_wait([timer, deadline](asio::error_code ec) {
+        if (!ec) wait_for_sessions(timer, deadline);
+    });
+}
+
+// SIGINT, SIGTERM or SIGHUP: stop accepting, tell every client, and exit
+// once their outboxes are written or drain_secs have passed. The second
+// pass lets sessions accepted just before the listeners closed register.
+void drain(ChatServer& server) {
+    if (draining.exchange(true)) return;
+    cout << "Draining " << all_sessions().size() << " session(s)\n";
+    on_every_context([&server](size_t i) { server.stop_listening(i, false); }, [] {
+        on_every_context(ChatSession::flush_batches, [] {
+            for (auto& s : all_sessions()) s->shut_down();
+            auto deadline = Clock::now() + chrono::seconds(config.drain_secs);
+            wait_for_sessions(make_shared<asio::steady_timer>(io_pool->at(0)), deadline);
+        });
+    });
+}
+
+// What a new process gets from the one it takes over from.
+struct Inheritance {
+    vector<int> listeners;
+    vector<HandoffState> sessions;
+    vector<HandoffMail> mail;
+};
+
+#ifndef _WIN32
+// Handoff packets carry at most one fd, as SCM_RIGHTS.
+bool send_packet(int sock, string_view data, int fd) {
+    iovec iov{const_cast<char*>(data.data()), data.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == ssize_t(data.size());
+}
+
+// A view into buf, empty at EOF or on error; fd is -1 if none came along.
+string_view recv_packet(int sock, vector<char>& buf, int& fd) {
+    iovec iov{buf.data(), buf.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    fd = -1;
+    ssize_t n = recvmsg(sock, &msg, 0);
+    if (n <= 0) return {};
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    }
+    return string_view(buf.data(), size_t(n));
+}
+
+sockaddr_un unix_address(const string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw runtime_error("handoff path too long: " + path);
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+// The old process's side of a hot restart. A new process started with
+// --takeover connects to the Unix socket at path; this one then releases
+// its listeners, sends the ticks batched rooms hold, freezes every session
+// until its outbox is written, and passes listeners, sessions and offline
+// mail across (packets "L", "S" as in HandoffState, "M" as in HandoffMail,
+// then "D") before exiting. Sessions that can't flush within drain_secs stay
+// behind and are closed. Cluster links are not passed: the new process dials
+// its peers again.
+class HandoffServer {
+public:
+    HandoffServer(ChatServer& server, string path)
+        : server_(server), path_(std::move(path)), listener_(io_pool->at(0)), deadline_(io_pool->at(0)) {
+        sockaddr_un addr = unix_address(path_);
+        int fd = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        ::unlink(path_.c_str());   // left over from a process that didn't exit cleanly
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, 1) < 0) {
+            int err = errno;
+            if (fd >= 0) ::close(fd);
+            throw runtime_error("cannot listen on " + path_ + ": " + strerror(err));
+        }
+        listener_.assign(fd);
+        do_accept();
+    }
+
+    // From any session's thread.
+    void report(HandoffState st) {
+        lock_guard<mutex> lock(m_);
+        if (sent_) {
+            if (st.fd >= 0) ::close(st.fd);
+            return;
+        }
+        if (st.fd >= 0) states_.push_back(std::move(st));
+        if (--waiting_ == 0) asio::post(io_pool->at(0), [this] { send_all(); });
+    }
+
+private:
+    void do_accept() {
+        listener_.async_wait(asio::posix::stream_descriptor::wait_read, [this](asio::error_code ec) {
+            if (ec) return;
+            int peer = ::accept(listener_.native_handle(), nullptr, nullptr);
+            if (peer < 0 || draining) {
+                if (peer >= 0) ::close(peer);
+                do_accept();
+                return;
+            }
+            peer_ = peer;
+            begin();
+        });
+    }
+
+    void begin() {
+        draining = true;
+        cout << "Handing off to a new process\n";
+        on_every_context([this](size_t i) {
+            auto fds = server_.stop_listening(i, true);
+            lock_guard<mutex> lock(m_);
+            listeners_.insert(listeners_.end(), fds.begin(), fds.end());
+        }, [this] {
+            on_every_context(ChatSession::flush_batches, [this] { freeze_sessions(); });
+        });
+    }
+
+    void freeze_sessions() {
+        auto all = all_sessions();
+        {
+            lock_guard<mutex> lock(m_);
+            waiting_ = all.size();
+        }
+        if (all.empty()) {
+            send_all();
+            return;
+        }
+        deadline_.expires_after(chrono::seconds(config.drain_secs));
+        deadline_.async_wait([this](asio::error_code ec) {
+            if (!ec) send_all();
+        });
+        for (auto& s : all) s->freeze();
+    }
+
+    void send_all() {
+        vector<HandoffState> states;
+        vector<int> listeners;
+        {
+            lock_guard<mutex> lock(m_);
+            if (sent_) return;
+            sent_ = true;
+            states.swap(states_);
+            listeners.swap(listeners_);
+        }
+        deadline_.cancel();
+        ::unlink(path_.c_str());
+        for (int fd : listeners) {
+            send_packet(peer_, "L", fd);
+            ::close(fd);
+        }
+        size_t moved = 0;
+        for (auto& st : states) {
+            if (send_packet(peer_, encode_handoff(st), st.fd)) ++moved;
+            ::close(st.fd);
+        }
+        size_t mail = 0;
+        mailbox.take_all([&](SymbolId to, const FrameString& box) {
+            Mailbox::for_each(box, [&](SymbolId from, string_view text) {
+                HandoffMail m{user_names.name(to), user_names.name(from), string(text)};
+                if (send_packet(peer_, encode_mail(m), -1)) ++mail;
+            });
+        });
+        send_packet(peer_, "D", -1);
+        cout << "Handed " << moved << " session(s) and " << mail << " mailbox message(s) over\n";
+        io_pool->stop();   // peer_ stays open until exit: its EOF tells the new process we're gone
+    }
+
+    ChatServer& server_;
+    string path_;
+    asio::posix::stream_descriptor listener_;
+    asio::steady_timer deadline_;
+    int peer_ = -1;
+
+    mutex m_;
+    vector<int> listeners_;
+    vector<HandoffState> states_;
+    size_t waiting_ = 0;
+    bool sent_ = false;
+};
+
+unique_ptr<HandoffServer> handoff_server;
+
+void handoff_report(HandoffState st) {
+    if (handoff_server) handoff_server->report(std::move(st));
+}
+
+// The new process's side: collects listeners and sessions, then waits for
+// the old process to exit so its ports and log files are free.
+Inheritance take_over(const string& path) {
+    sockaddr_un addr = unix_address(path);
+    int sock = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || ::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        int err = errno;
+        if (sock >= 0) ::close(sock);
+        throw runtime_error("cannot take over through " + path + ": " + strerror(err));
+    }
+    Inheritance got;
+    vector<char> buf(1 << 20);
+    while (true) {
+        int fd;
+        string_view packet = recv_packet(sock, buf, fd);
+        if (packet.empty()) {
+            ::close(sock);
+            throw runtime_error("handoff through " + path + " broke off");
+        }
+        if (packet == "D") break;
+        HandoffState st;
+        HandoffMail m;
+        if (packet == "L" && fd >= 0) {
+            got.listeners.push_back(fd);
+        } else if (fd < 0 && decode_mail(packet, m)) {
+            got.mail.push_back(std::move(m));
+        } else if (fd >= 0 && decode_handoff(packet, st)) {
+            st.fd = fd;
+            got.sessions.push_back(std::move(st));
+        } else if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    pollfd p{sock, POLLIN, 0};
+    char c;
+    while (::poll(&p, 1, int(config.drain_secs + 5) * 1000) > 0 && ::recv(sock, &c, 1, 0) > 0) {}
+    ::close(sock);
+    return got;
+}
+#else
+void handoff_report(HandoffState) {}
+#endif
+
+int main(int argc, char* argv[]) {
+    try {
+        config = parse_args(argc, argv);
+        io_pool = make_unique<IoContextPool>(config.threads);
+        shard_mesh = make_unique<ShardMesh>(io_pool->size());
+        if (config.handshake_secs || config.idle_secs || config.ping_secs) {
+            for (size_t i = 0; i < io_pool->size(); ++i) {
+                wheels.push_back(make_unique<TimingWheel<ChatSession>>(io_pool->at(i), chrono::seconds(1)));
+            }
+        }
+        Inheritance inherited;
+        if (!config.takeover_path.empty() || !config.handoff_path.empty()) {
+#ifdef _WIN32
+            throw runtime_error("--handoff and --takeover need a POSIX system");
+#else
+            if (!config.takeover_path.empty()) {
+                inherited = take_over(config.takeover_path);
+                cout << "Took over " << inherited.sessions.size() << " session(s) and " << inherited.mail.size()
+                     << " mailbox message(s) from " << config.takeover_path << "\n";
+            }
+#endif
+        }
+        if (!config.log_dir.empty()) {
+#ifdef _WIN32
+            throw runtime_error("--log-dir needs a POSIX system");
+#else
+            message_log = make_unique<MessageLog>(config.log_dir);
+#endif
+        }
+
+        ChatServer server(config.port, inherited.listeners);
+        presence.start(io_pool->at(0));
+        if (!config.cluster_addr.empty()) {
+            cluster = make_unique<Cluster>(config.cluster_addr, config.peers);
+            cluster->start();
+            cout << "Cluster node " << config.cluster_addr << " with " << config.peers.size() << " peer(s)\n";
+        }
+        unique_ptr<AdminServer> admin;
+        if (config.admin_port) {
+            admin = make_unique<AdminServer>(io_pool->at(0), config.admin_port);
+            cout << "Metrics on http://0.0.0.0:" << config.admin_port << "/metrics"
+                 << (config.trace_sample ? ", traces on /trace\n" : "\n");
+        }
+        // before the sessions sign in again and drain their mail
+        for (auto& m : inherited.mail) {
+            SymbolId to = user_names.intern(m.to, config.max_names);
+            SymbolId from = user_names.intern(m.from, config.max_names);
+            if (to && from && config.mailbox_bytes) mailbox.store(to, from, m.text);
+        }
+        server.adopt(std::move(inherited.sessions));
+#ifndef _WIN32
+        if (!config.handoff_path.empty()) handoff_server = make_unique<HandoffServer>(server, config.handoff_path);
+#endif
+        asio::signal_set signals(io_pool->at(0), SIGINT, SIGTERM);
+#ifdef SIGHUP
+        signals.add(SIGHUP);
+#endif
+        signals.async_wait([&server](asio::error_code ec, int) {
+            if (!ec) drain(server);
+        });
+
+        cout << "Async Chat Server (Made by JavadInteger) is running on port \"" << config.port << "\" with "
+             << config.threads << " io thread(s)"
+#ifdef CHAT_COROUTINES
+             << ", coroutine sessions"
+#endif
+             << "\n";
+
+        io_pool->run();
+        // Joins the log writer, which commits what is still queued; a new
+        // process taking over doesn't read the logs until this one exits.
+        message_log.reset();
+        // Sessions still around (handed off, or past the drain deadline) hold
+        // pool blocks whose thread caches are gone by static destruction;
+        // the OS reclaims them instead.
+        cout.flush();
+        quick_exit(0);
+    } catch (const exception& e) {
+        cerr << "❌ Error: " << e.what() << "\n";
+        return 1;
+    }
+}
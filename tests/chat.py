@@ -0,0 +1,262 @@
+"""Helpers for the end-to-end tests: start a server, connect clients to it.
+
+The server binary is taken from $CHAT_SERVER (default ./Messanger). Every
+server gets a fresh port, so tests don't depend on 8080 being free.
+"""
+import os
+import re
+import signal
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+import unittest
+
+SERVER = os.environ.get("CHAT_SERVER", "./Messanger")
+BINARY_MAGIC = b"\0CB\1"
+
+# server opcodes
+WELCOME, INFO, ROOM_MSG, PV_MSG, JOINED, PING, ERROR = 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x8F
+# client opcodes
+NAME, JOIN, PV, LEAVE, CHAT, WHEREAMI, ROOMS, USERS, STATS, PRESENCE, PONG = range(1, 12)
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def packet(op, payload=b"", id=0):
+    return struct.pack(">BBII", op, 0, id, len(payload)) + payload
+
+
+class Server:
+    """One server process; extra arguments go on its command line."""
+
+    def __init__(self, *args, port=None, wait=True):
+        """With wait=False, call wait_listening() before connecting; a
+        process taking over should only be probed once the old one is gone."""
+        self.port = port or free_port()
+        self.args = [SERVER, "--port", str(self.port), *args]
+        self.clients = []
+        self.proc = subprocess.Popen(self.args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        if wait:
+            self.wait_listening()
+
+    def wait_listening(self, timeout=5):
+        end = time.time() + timeout
+        while time.time() < end:
+            if self.proc.poll() is not None:
+                raise AssertionError("server exited: " + self.proc.stdout.read())
+            try:
+                socket.create_connection(("127.0.0.1", self.port), timeout=0.2).close()
+                return
+            except OSError:
+                time.sleep(0.05)
+        raise AssertionError("server did not listen on %d" % self.port)
+
+    def client(self, name=None, wait_free=False):
+        """A text client, signed in as name if given. With wait_free it
+        retries while an old session still holds the name."""
+        end = time.time() + 5
+        while True:
+            c = Client(self.port)
+            self.clients.append(c)
+            if not name:
+                return c
+            c.send(name)
+            got = c.expect(re.compile(r"Hi |Try another: "))
+            if got.endswith("Hi "):
+                return c
+            c.close()
+            if not wait_free or time.time() > end:
+                raise AssertionError("could not sign in as %s: %r" % (name, got))
+
+    def binary_client(self, name=None):
+        c = BinaryClient(self.port)
+        self.clients.append(c)
+        if name:
+            c.send(NAME, name)
+            c.expect(WELCOME)
+        return c
+
+    def stop(self, sig=signal.SIGTERM, timeout=10):
+        """Signals the server and returns everything it printed."""
+        if self.proc.poll() is None:
+            self.proc.send_signal(sig)
+        try:
+            self.proc.wait(timeout=timeout)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+            raise AssertionError("server did not exit on signal %d" % sig)
+        return self.proc.stdout.read()
+
+
+class Client:
+    """A text-protocol client; reads are decoded and collected until quiet."""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+        self.sock.settimeout(0.05)
+        self.buf = ""
+
+    def send(self, *lines):
+        self.sock.sendall("".join(line + "\n" for line in lines).encode())
+
+    def send_raw(self, data):
+        self.sock.sendall(data)
+
+    def _fill(self):
+        try:
+            d = self.sock.recv(1 << 20)
+        except socket.timeout:
+            return True
+        if not d:
+            return False
+        self.buf += d.decode(errors="replace")
+        return True
+
+    def read(self, quiet=0.2, timeout=5):
+        """Everything that arrives until nothing has for quiet seconds."""
+        end = time.time() + timeout
+        last = time.time()
+        while time.time() < end and time.time() - last < quiet:
+            before = len(self.buf)
+            if not self._fill():
+                break
+            if len(self.buf) != before:
+                last = time.time()
+        out, self.buf = self.buf, ""
+        return out
+
+    def _find_end(self, text):
+        if isinstance(text, re.Pattern):
+            m = text.search(self.buf)
+            return m.end() if m else -1
+        i = self.buf.find(text)
+        return i + len(text) if i >= 0 else -1
+
+    def expect(self, text, timeout=5):
+        """Reads until text (a string or compiled regex) shows up; returns
+        what came up to and including it."""
+        end = time.time() + timeout
+        while True:
+            i = self._find_end(text)
+            if i >= 0:
+                out, self.buf = self.buf[:i], self.buf[i:]
+                return out
+            if time.time() >= end or not self._fill():
+                raise AssertionError("never got %r; got %r" % (text, self.buf))
+
+    def closed(self, timeout=5):
+        end = time.time() + timeout
+        while time.time() < end:
+            if not self._fill():
+                return True
+        return False
+
+    def close(self):
+        self.sock.close()
+
+
+class BinaryClient:
+    """A binary-protocol client; packets are (op, id, payload) tuples."""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+        self.sock.settimeout(0.05)
+        self.sock.sendall(BINARY_MAGIC)
+        self.raw = b""
+        self.pending = []
+        self.negotiated = False
+
+    def send(self, op, payload=b"", id=0):
+        if isinstance(payload, str):
+            payload = payload.encode()
+        self.sock.sendall(packet(op, payload, id))
+
+    def _fill(self):
+        try:
+            d = self.sock.recv(1 << 20)
+        except socket.timeout:
+            return True
+        if not d:
+            return False
+        self.raw += d
+        if not self.negotiated:
+            i = self.raw.find(BINARY_MAGIC)
+            if i >= 0:
+                self.raw = self.raw[i + len(BINARY_MAGIC):]
+                self.negotiated = True
+        return True
+
+    def _parse(self):
+        while self.negotiated and len(self.raw) >= 10:
+            op, _, id, n = struct.unpack(">BBII", self.raw[:10])
+            if len(self.raw) < 10 + n:
+                break
+            self.pending.append((op, id, self.raw[10:10 + n]))
+            self.raw = self.raw[10 + n:]
+
+    def read(self, quiet=0.2, timeout=5):
+        end = time.time() + timeout
+        last = time.time()
+        while time.time() < end and time.time() - last < quiet:
+            before = len(self.raw)
+            if not self._fill():
+                break
+            if len(self.raw) != before:
+                last = time.time()
+        self._parse()
+        out, self.pending = self.pending, []
+        return out
+
+    def expect(self, op, timeout=5):
+        """Reads until a packet with op arrives; returns the packets up to
+        and including it."""
+        end = time.time() + timeout
+        while True:
+            self._parse()
+            for i, p in enumerate(self.pending):
+                if p[0] == op:
+                    out, self.pending = self.pending[:i + 1], self.pending[i + 1:]
+                    return out
+            if time.time() >= end or not self._fill():
+                raise AssertionError("never got opcode %#x; got %r" % (op, self.pending))
+
+    def close(self):
+        self.sock.close()
+
+
+def chat_lines(text, room):
+    """The "name [room]: text" lines of a text reply, as (name, text)."""
+    return re.findall(r"^(\S+) \[" + re.escape(room) + r"\]: (.*)$", text, re.M)
+
+
+class ServerTest(unittest.TestCase):
+    """Stops every server a test started, even when it fails."""
+
+    def setUp(self):
+        self.servers = []
+        self.tmp = tempfile.TemporaryDirectory()
+
+    def tearDown(self):
+        for s in self.servers:
+            for c in s.clients:
+                c.close()
+            if s.proc.poll() is None:
+                s.proc.kill()
+                s.proc.wait()
+            s.proc.stdout.close()
+        self.tmp.cleanup()
+
+    def server(self, *args, **kw):
+        s = Server("--colors", "off", *args, **kw)
+        self.servers.append(s)
+        return s
+
+    def path(self, name):
+        return os.path.join(self.tmp.name, name)
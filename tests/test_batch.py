@@ -0,0 +1,57 @@
+"""Batched rooms (--batch-room, --batch-ms, --batch-bytes)."""
+import time
+import unittest
+
+from chat import ServerTest, chat_lines
+
+
+class BatchTest(ServerTest):
+    def join_all(self, s, names, room="ev"):
+        clients = [s.client(n) for n in names]
+        for c in clients:
+            c.send("/join " + room)
+        for c in clients:
+            c.expect("You are now in room")
+        time.sleep(0.2)
+        for c in clients:
+            c.read()
+        return clients
+
+    def test_tick_reaches_everyone_but_the_senders_own_lines(self):
+        s = self.server("--batch-room", "ev", "--batch-ms", "200")
+        a, b, c = self.join_all(s, ["a", "b", "c"])
+        a.send(*["a%d" % i for i in range(5)])
+        b.send(*["b%d" % i for i in range(5)])
+        time.sleep(0.05)
+        self.assertEqual(c.read(quiet=0.05, timeout=0.1), "", "delivered before the tick ended")
+        got = chat_lines(c.read(quiet=0.4), "ev")
+        self.assertEqual([t for n, t in got if n == "a"], ["a%d" % i for i in range(5)])
+        self.assertEqual([t for n, t in got if n == "b"], ["b%d" % i for i in range(5)])
+        self.assertEqual(chat_lines(a.read(), "ev"), [("b", "b%d" % i) for i in range(5)])
+        self.assertEqual(chat_lines(b.read(), "ev"), [("a", "a%d" % i) for i in range(5)])
+
+    def test_full_tick_goes_out_early(self):
+        s = self.server("--batch-room", "ev", "--batch-ms", "5000", "--batch-bytes", "256")
+        a, b = self.join_all(s, ["a", "b"])
+        a.send(*["line %d of a tick that fills up" % i for i in range(20)])
+        got = chat_lines(b.read(quiet=0.3, timeout=2), "ev")
+        self.assertGreaterEqual(len(got), 5)
+
+    def test_notices_follow_the_chat_held_before_them(self):
+        s = self.server("--batch-room", "ev", "--batch-ms", "1000")
+        a, b = self.join_all(s, ["a", "b"])
+        a.send("before")
+        a.send("/leave")
+        got = b.read(quiet=0.3)
+        self.assertIn("a [ev]: before\n", got)
+        self.assertLess(got.index("before"), got.index("a left room ev."))
+
+    def test_other_rooms_are_not_batched(self):
+        s = self.server("--batch-room", "ev", "--batch-ms", "5000")
+        a, b = self.join_all(s, ["a", "b"], room="plain")
+        a.send("now")
+        b.expect("a [plain]: now\n", timeout=1)
+
+
+if __name__ == "__main__":
+    unittest.main()
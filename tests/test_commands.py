@@ -0,0 +1,65 @@
+"""Command dispatch through the command table."""
+import unittest
+
+from chat import ServerTest
+
+
+class CommandTest(ServerTest):
+    def in_room(self, s, *names):
+        clients = [s.client(n) for n in names]
+        for c in clients:
+            c.send("/join r")
+            c.expect("You are now in room r.")
+        for c in clients:
+            c.read()
+        return clients
+
+    def test_commands_missing_their_argument_get_usage(self):
+        s = self.server()
+        a = s.client("a")
+        for cmd, usage in (("/join", "/join <room>"), ("/pv", "/pv <user>"),
+                           ("/presence", "/presence on|off"), ("/color", "/color on|off")):
+            a.send(cmd + "   ")
+            a.expect("Usage: %s\n" % usage)
+
+    def test_unknown_commands_are_chat(self):
+        s = self.server()
+        a, b = self.in_room(s, "a", "b")
+        a.send("/shrug", "/", "/j r", "/joinx r")
+        b.expect("a [r]: /shrug\na [r]: /\na [r]: /j r\na [r]: /joinx r\n")
+
+    def test_each_command_reaches_its_handler(self):
+        s = self.server()
+        a, b = self.in_room(s, "a", "b")
+        a.send("/whereami")
+        a.expect("You are in room: r\n")
+        a.send("/rooms")
+        a.expect("Rooms:\n- r (2 users)\n")
+        a.send("/users")
+        a.expect("Users:\n- a\n- b\n")
+        a.send("/stats")
+        a.expect("Outbound backpressure: ")
+        a.send("/pv b")
+        a.expect("Private chat with b started.")
+        a.send("/leave")
+        a.expect("You left all contexts. Mode: none.\n")
+        a.send("/pong", "/whereami")
+        a.expect("You are in: none\n")
+
+    def test_listing_pages_by_cursor(self):
+        s = self.server("--list-page", "2")
+        a = s.client("a")
+        a.send("/join r1", "/join r2", "/join r3")
+        for name in ("x2", "x3"):
+            c = s.client(name)
+            c.send("/join " + name)
+            c.expect("You are now in room")
+        a.read()
+        a.send("/users")
+        a.expect("Users:\n- a\n- x2\nMore: /users * x2\n")
+        a.send("/users * x2")
+        a.expect("Users:\n- x3\n")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,99 @@
+"""Connecting: the text greeting, the binary magic, framing and the
+handshake timeout. Run these against a CHAT_COROUTINES build as well."""
+import time
+import unittest
+
+from chat import (BINARY_MAGIC, CHAT, ERROR, INFO, JOIN, JOINED, NAME, ROOM_MSG, WELCOME, WHEREAMI, Client,
+                  ServerTest, packet)
+
+
+class HandshakeTest(ServerTest):
+    def test_text_greeting_and_name(self):
+        s = self.server()
+        c = s.client()
+        c.expect("Welcome! Please enter your name: ")
+        c.send("alice")
+        c.expect("Hi alice! Commands: /join <room>")
+
+    def test_taken_name_asks_again(self):
+        s = self.server()
+        s.client("alice")
+        c = s.client()
+        c.send("alice")
+        c.expect("Name already taken. Try another: ")
+        c.send("alicia")
+        c.expect("Hi alicia!")
+
+    def test_lines_split_across_reads(self):
+        s = self.server()
+        a, b = s.client("a"), s.client("b")
+        a.send("/join r")
+        b.send("/join r")
+        b.expect("You are now in room r.")
+        for part in (b"hel", b"lo\r", b"\nworld\n"):
+            a.send_raw(part)
+            time.sleep(0.05)
+        b.expect("a [r]: hello\na [r]: world\n")
+
+    def test_overlong_line_is_dropped(self):
+        s = self.server("--max-line", "64")
+        a = s.client("a")
+        a.send("x" * 200, "/whereami")
+        got = a.read()
+        self.assertIn("Line too long (max 64 bytes), dropped.\n", got)
+        self.assertIn("You are in: none\n", got)
+        self.assertNotIn("xxx", got)
+
+    def test_binary_handshake(self):
+        s = self.server()
+        b = s.binary_client()
+        b.send(NAME, "bot")
+        op, id, payload = b.expect(WELCOME)[-1]
+        self.assertEqual(payload, b"bot")
+        self.assertNotEqual(id, 0)
+        t = s.client("human")
+        t.send("/join lobby")
+        b.send(JOIN, "lobby")
+        self.assertEqual(b.expect(JOINED)[-1][2], b"lobby")
+        b.send(CHAT, "hi human")
+        t.expect("bot [lobby]: hi human\n")
+        t.send("hello bot")
+        self.assertEqual(b.expect(ROOM_MSG)[-1][2], b"\x05humanhello bot")
+
+    def test_binary_magic_split_across_reads(self):
+        s = self.server()
+        c = Client(s.port)
+        s.clients.append(c)
+        c.send_raw(BINARY_MAGIC[:2])
+        time.sleep(0.05)
+        c.send_raw(BINARY_MAGIC[2:] + packet(NAME, b"bot"))
+        got = c.expect("bot")
+        self.assertIn(BINARY_MAGIC, got.encode())
+
+    def test_binary_refusals(self):
+        s = self.server()
+        b = s.binary_client("bot")
+        b.send(JOIN, "")
+        self.assertEqual(b.expect(ERROR)[-1][0], ERROR)
+        b.send(CHAT, "bad\x1b[31m")
+        b.expect(ERROR)
+        b.send(JOIN, "ok")
+        b.expect(JOINED)
+
+    def test_binary_info_for_commands(self):
+        s = self.server()
+        b = s.binary_client("bot")
+        b.send(WHEREAMI)
+        self.assertIn(b"none", b.expect(INFO)[-1][2])
+
+    def test_silent_connections_time_out(self):
+        s = self.server("--handshake-timeout", "1")
+        c = s.client()
+        c.expect("Welcome!")
+        self.assertTrue(c.closed(timeout=4))
+        named = s.client("alice")
+        self.assertFalse(named.closed(timeout=1.5))
+
+
+if __name__ == "__main__":
+    unittest.main()
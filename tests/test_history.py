@@ -0,0 +1,114 @@
+"""Room history from the message log (--log-dir, --history, /history)."""
+import os
+import re
+import threading
+import time
+import unittest
+
+from chat import ServerTest, chat_lines
+
+
+class HistoryTest(ServerTest):
+    def logged_server(self, *args):
+        return self.server("--log-dir", self.path("log"), *args)
+
+    def fill(self, s, room, count, name="w"):
+        w = s.client(name)
+        w.send("/join " + room, *["%s-%d" % (name, i) for i in range(count)])
+        time.sleep(0.3)
+        return w
+
+    def join(self, s, name, room):
+        c = s.client(name)
+        c.send("/join " + room)
+        c.expect("You are now in room")
+        return [t for _, t in chat_lines(c.read(), room)]
+
+    def test_join_replays_the_last_messages(self):
+        s = self.logged_server("--history", "5")
+        self.fill(s, "h", 30)
+        self.assertEqual(self.join(s, "r", "h"), ["w-%d" % i for i in range(25, 30)])
+
+    def test_uncommitted_tail_is_replayed(self):
+        # Nothing is committed for a minute; the joiner still sees it all.
+        s = self.logged_server("--history", "10", "--log-commit-ms", "60000")
+        self.fill(s, "h", 10)
+        self.assertEqual(self.join(s, "r", "h"), ["w-%d" % i for i in range(10)])
+
+    def test_history_survives_a_restart(self):
+        s = self.logged_server("--history", "5")
+        self.fill(s, "h", 8)
+        s.stop()
+        s = self.logged_server("--history", "5")
+        self.assertEqual(self.join(s, "r", "h"), ["w-%d" % i for i in range(3, 8)])
+
+    def test_history_command_asks_for_more(self):
+        s = self.logged_server("--history", "2")
+        self.fill(s, "h", 12)
+        c = s.client("r")
+        c.send("/join h")
+        c.expect("You are now in room")
+        c.read()
+        c.send("/history 10")
+        self.assertEqual([t for _, t in chat_lines(c.read(), "h")], ["w-%d" % i for i in range(2, 12)])
+
+    def test_history_needs_a_log(self):
+        s = self.server()
+        c = s.client("r")
+        c.send("/join h", "/history")
+        c.expect("History is not kept on this server (see --log-dir).\n")
+
+    def test_old_segments_are_dropped_at_startup(self):
+        log = self.path("log")
+        args = ["--log-dir", log, "--log-segment-bytes", "65536"]
+        s = self.server(*args, "--log-segments", "8")
+        w = s.client("w")
+        w.send("/join h", *[("%d " % i) + "x" * 1000 for i in range(150)])   # about 2 KiB a record
+        time.sleep(0.5)
+        s.stop()
+        segments = lambda: sorted(f for f in os.listdir(log) if f.endswith(".seg"))
+        before = segments()
+        self.assertGreater(len(before), 2)
+        s = self.server(*args, "--log-segments", "2")
+        self.assertEqual(segments(), before[-2:])
+
+    def test_batched_room_replays_without_duplicates(self):
+        s = self.logged_server("--history", "10", "--batch-room", "h", "--batch-ms", "500")
+        w = s.client("w")
+        w.send("/join h", "one", "two")
+        time.sleep(0.1)
+        self.assertEqual(self.join(s, "r", "h"), ["one", "two"])
+
+    def test_joiners_see_no_gap_between_replay_and_live_chat(self):
+        s = self.logged_server("--history", "20")
+        w = s.client("w")
+        w.send("/join g")
+        w.expect("You are now in room")
+        stop = threading.Event()
+
+        def spam():
+            i = 0
+            while not stop.is_set():
+                w.send("n%d" % i)
+                i += 1
+                time.sleep(0.002)
+
+        t = threading.Thread(target=spam, daemon=True)
+        t.start()
+        try:
+            time.sleep(0.3)
+            for k in range(10):
+                c = s.client("j%d" % k)
+                c.send("/join g")
+                out = c.read(quiet=0.4, timeout=0.4)
+                c.close()
+                nums = [int(n) for n in re.findall(r"^w \[g\]: n(\d+)$", out, re.M)]
+                self.assertGreater(len(nums), 20)
+                self.assertEqual(nums, list(range(nums[0], nums[0] + len(nums))), "joiner %d" % k)
+        finally:
+            stop.set()
+            t.join()
+
+
+if __name__ == "__main__":
+    unittest.main()
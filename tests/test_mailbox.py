@@ -0,0 +1,65 @@
+"""Offline PV mailbox (--mailbox-bytes, --mailbox-total-bytes)."""
+import time
+import unittest
+
+from chat import NAME, PV_MSG, WELCOME, ServerTest
+
+
+class MailboxTest(ServerTest):
+    def leave_mail(self, s, to, lines, sender="alice"):
+        s.client(to).close()
+        time.sleep(0.1)   # let the server see them go
+        a = s.client(sender)
+        a.send("/pv " + to)
+        a.expect("messages will wait in their mailbox.\n")
+        a.send(*lines)
+        return a
+
+    def test_mail_is_drained_in_one_batch_on_sign_in(self):
+        s = self.server()
+        a = self.leave_mail(s, "bob", ["one", "two", "three"])
+        a.expect("User is offline; message saved to their mailbox.\n" * 3)
+        b = s.client()
+        b.send("bob")
+        b.expect("You have 3 message(s) from while you were away:\n"
+                 "alice (PV): one\nalice (PV): two\nalice (PV): three\n")
+        b.close()
+        again = s.client("bob")
+        self.assertNotIn("away", again.read())
+
+    def test_binary_clients_get_pv_packets(self):
+        s = self.server()
+        self.leave_mail(s, "bot", ["queued"]).expect("saved to their mailbox")
+        b = s.binary_client()
+        b.send(NAME, "bot")
+        b.expect(WELCOME)
+        _, _, payload = b.expect(PV_MSG)[-1]
+        self.assertEqual(payload, b"\x05alicequeued")
+
+    def test_full_mailbox_refuses_more(self):
+        s = self.server("--mailbox-bytes", "40")
+        a = self.leave_mail(s, "bob", ["x" * 20, "y" * 20])
+        a.expect("User is offline; message saved to their mailbox.\n")
+        a.expect("User is offline and their mailbox is full; message not saved.\n")
+        b = s.client()
+        b.send("bob")
+        got = b.expect("x" * 20 + "\n")
+        self.assertIn("You have 1 message(s)", got)
+
+    def test_only_names_seen_before_have_a_mailbox(self):
+        s = self.server()
+        a = s.client("alice")
+        a.send("/pv carol")
+        a.expect("User not found.\n")
+
+    def test_mailbox_off(self):
+        s = self.server("--mailbox-bytes", "0")
+        s.client("bob").close()
+        time.sleep(0.1)
+        a = s.client("alice")
+        a.send("/pv bob")
+        a.expect("User not found.\n")
+
+
+if __name__ == "__main__":
+    unittest.main()
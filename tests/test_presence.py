@@ -0,0 +1,62 @@
+"""Presence digests (--presence-ms, /presence on|off)."""
+import time
+import unittest
+
+from chat import ServerTest
+
+
+class PresenceTest(ServerTest):
+    def test_joins_and_leaves_come_as_one_digest(self):
+        s = self.server("--presence-ms", "100")
+        watcher = s.client("watcher")
+        watcher.expect("Presence: joined watcher.\n")
+        others = [s.client("u%d" % i) for i in range(5)]
+        got = watcher.expect("Presence: joined u0, u1, u2, u3, u4.\n")
+        self.assertEqual(got.count("Presence:"), 1)
+        others[0].close()
+        others[1].close()
+        watcher.expect("Presence: left u0, u1.\n")
+
+    def test_net_zero_changes_are_left_out(self):
+        s = self.server("--presence-ms", "300")
+        watcher = s.client("watcher")
+        watcher.expect("Presence: joined watcher.\n")
+        s.client("brief").close()
+        s.client("stays")
+        watcher.expect("Presence: joined stays.\n")
+        self.assertNotIn("brief", watcher.read(quiet=0.5))
+
+    def test_opting_out(self):
+        s = self.server("--presence-ms", "100")
+        quiet = s.client("quiet")
+        quiet.send("/presence off")
+        quiet.read()
+        watcher = s.client("watcher")
+        watcher.expect("Presence: joined watcher.\n")
+        s.client("newcomer")
+        watcher.expect("Presence: joined newcomer.\n")
+        self.assertNotIn("Presence", quiet.read(quiet=0.4))
+
+    def test_reconnecting_under_the_same_name_keeps_the_subscription(self):
+        # The old session unsubscribes while it still holds the name, so it
+        # can't undo the new session's subscription. The window is narrow;
+        # this only catches a regression some of the time.
+        s = self.server("--presence-ms", "100", "--threads", "4")
+        names = ["u%d" % i for i in range(40)]
+        clients = {n: s.client(n) for n in names}
+        time.sleep(0.3)
+        for _ in range(3):
+            for n in names:
+                clients[n].close()
+                clients[n] = s.client(n, wait_free=True)
+        time.sleep(0.5)
+        for c in clients.values():
+            c.read(quiet=0.01)
+        s.client("trigger")
+        time.sleep(0.5)
+        missed = [n for n, c in clients.items() if "trigger" not in c.read(quiet=0.05)]
+        self.assertEqual(missed, [])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,51 @@
+"""Token-bucket rate limits (--user-rate, --room-rate): reads pause, nothing
+is dropped."""
+import time
+import unittest
+
+from chat import ServerTest, chat_lines
+
+
+class RateTest(ServerTest):
+    def room(self, s, names):
+        clients = [s.client(n) for n in names]
+        for c in clients:
+            c.send("/join r")
+            c.expect("You are now in room")
+        time.sleep(0.2)
+        for c in clients:
+            c.read()
+        return clients
+
+    def test_user_over_the_rate_is_paused_not_dropped(self):
+        s = self.server("--user-rate", "20", "--user-burst", "5")
+        a, w = self.room(s, ["a", "w"])
+        start = time.time()
+        a.send(*["m%d" % i for i in range(25)])
+        early = chat_lines(w.read(quiet=0.05, timeout=0.3), "r")
+        self.assertLess(len(early), 15, "burst of 5 plus 20/s should hold most lines back")
+        got = early + chat_lines(w.read(quiet=0.5, timeout=5), "r")
+        self.assertEqual([t for _, t in got], ["m%d" % i for i in range(25)])
+        self.assertGreater(time.time() - start, 0.8)
+
+    def test_room_rate_is_shared_by_its_senders(self):
+        s = self.server("--room-rate", "20", "--room-burst", "5")
+        a, b, w = self.room(s, ["a", "b", "w"])
+        a.send(*["a%d" % i for i in range(15)])
+        b.send(*["b%d" % i for i in range(15)])
+        early = chat_lines(w.read(quiet=0.05, timeout=0.3), "r")
+        self.assertLess(len(early), 15)
+        got = early + chat_lines(w.read(quiet=0.5, timeout=5), "r")
+        self.assertEqual([t for n, t in got if n == "a"], ["a%d" % i for i in range(15)])
+        self.assertEqual([t for n, t in got if n == "b"], ["b%d" % i for i in range(15)])
+
+    def test_commands_count_against_the_user_rate_only(self):
+        s = self.server("--room-rate", "1", "--room-burst", "1")
+        a, w = self.room(s, ["a", "w"])
+        a.send("first", "/whereami", "/whereami")
+        got = a.expect("You are in room: r\nYou are in room: r\n", timeout=0.5)
+        self.assertNotIn("first", got)
+
+
+if __name__ == "__main__":
+    unittest.main()
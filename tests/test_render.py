@@ -0,0 +1,59 @@
+"""ANSI and plain rendering (--colors, /color on|off)."""
+import time
+import unittest
+
+from chat import ServerTest
+
+
+class RenderTest(ServerTest):
+    def test_colored_and_plain_members_of_one_room(self):
+        s = self.server("--colors", "on")
+        a, b, c = s.client("a"), s.client("b"), s.client("c")
+        c.send("/color off")
+        c.expect("Colors off.")
+        for x in (a, b, c):
+            x.send("/join r")
+            x.expect("You are now in room r.")
+        time.sleep(0.1)
+        b.read()
+        c.read()
+        a.send("hello")
+        self.assertRegex(b.expect("hello\n"), r"\x1b\[\d+ma\x1b\[0m \[r\]: hello\n$")
+        self.assertEqual(c.expect("hello\n").split("\n")[-2], "a [r]: hello")
+
+    def test_switching_mid_room(self):
+        s = self.server("--colors", "on")
+        a, b = s.client("a"), s.client("b")
+        for x in (a, b):
+            x.send("/join r")
+            x.expect("You are now in room r.")
+        b.send("/color off")
+        b.expect("Colors off.")
+        a.send("one")
+        self.assertNotIn("\x1b", b.expect("one\n"))
+        b.send("/color on")
+        b.expect("Colors on.")
+        a.send("two")
+        self.assertIn("\x1b", b.expect("two\n"))
+
+    def test_plain_server_default(self):
+        s = self.server()
+        a = s.client()
+        a.send("alice")
+        self.assertNotIn("\x1b", a.expect("Commands:"))
+
+    def test_history_is_plain_for_plain_clients(self):
+        s = self.server("--colors", "on", "--log-dir", self.path("log"), "--history", "5")
+        w = s.client("w")
+        w.send("/join h", "logged")
+        time.sleep(0.2)
+        r = s.client("r")
+        r.send("/color off", "/join h")
+        r.expect("You are now in room h.")
+        self.assertIn("w [h]: logged\n", r.read())
+        r.send("/history 1")
+        self.assertEqual(r.read(), "w [h]: logged\n")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,88 @@
+"""Drain on signals and hot restart (--drain-secs, --handoff, --takeover)."""
+import signal
+import time
+import unittest
+
+from chat import ServerTest
+
+
+class RestartTest(ServerTest):
+    def test_drain_tells_clients_and_exits(self):
+        s = self.server()
+        a = s.client("a")
+        a.read()
+        out = s.stop(signal.SIGTERM)
+        self.assertEqual(s.proc.returncode, 0)
+        self.assertIn("Draining ", out)
+        a.expect("Server is shutting down.\n")
+        self.assertTrue(a.closed())
+
+    def test_sessions_move_to_the_new_process(self):
+        sock = self.path("handoff.sock")
+        old = self.server("--handoff", sock)
+        a, b, c = old.client("alice"), old.client("bob"), old.client("carol")
+        a.send("/join r")
+        b.send("/join r")
+        c.send("/pv alice")
+        a.expect("You are now in room r.")
+        b.expect("You are now in room r.")
+        c.expect("Private chat with alice started.")
+        time.sleep(0.2)
+        for x in (a, b, c):
+            x.read()
+        a.send_raw(b"hel")   # half a line across the restart
+        new = self.server("--takeover", sock, port=old.port, wait=False)
+        old.proc.wait(timeout=10)
+        new.wait_listening()
+        self.assertIn("Handed 3 session(s)", old.proc.stdout.read())
+        a.send_raw(b"lo bob\n")
+        b.expect("alice [r]: hello bob\n")
+        c.send("psst")
+        a.expect("carol (PV): psst\n")
+        b.send("/whereami")
+        b.expect("You are in room: r\n")
+        late = new.client()
+        late.send("alice")
+        late.expect("Name already taken.")
+
+    def test_mailbox_and_held_tick_move_too(self):
+        sock = self.path("handoff.sock")
+        args = ["--batch-room", "ev", "--batch-ms", "3000"]
+        old = self.server("--handoff", sock, *args)
+        old.client("dave").close()
+        a, b = old.client("alice"), old.client("bob")
+        for x in (a, b):
+            x.send("/join ev")
+            x.expect("You are now in room ev.")
+        time.sleep(0.2)
+        b.read()
+        a.send("held in the tick")
+        e = old.client("eve")
+        e.send("/pv dave", "see you later")
+        e.expect("saved to their mailbox")
+        new = self.server("--takeover", sock, *args, port=old.port, wait=False)
+        old.proc.wait(timeout=10)
+        new.wait_listening()
+        self.assertIn("and 1 mailbox message(s) over", old.proc.stdout.read())
+        b.expect("alice [ev]: held in the tick\n")
+        d = new.client()
+        d.send("dave")
+        d.expect("eve (PV): see you later\n")
+
+    def test_room_history_is_committed_before_the_new_process_reads_it(self):
+        sock = self.path("handoff.sock")
+        args = ["--log-dir", self.path("log"), "--log-commit-ms", "60000", "--history", "5"]
+        old = self.server("--handoff", sock, *args)
+        w = old.client("w")
+        w.send("/join h", "one", "two")
+        time.sleep(0.2)
+        new = self.server("--takeover", sock, *args, port=old.port, wait=False)
+        old.proc.wait(timeout=10)
+        new.wait_listening()
+        r = new.client("r")
+        r.send("/join h")
+        r.expect("w [h]: one\nw [h]: two\n")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,75 @@
+"""Several io threads: rooms and users on different shards, work handed
+between them."""
+import random
+import threading
+import time
+import unittest
+
+from chat import ServerTest, chat_lines
+
+
+class ShardTest(ServerTest):
+    def test_pv_between_shards_arrives_in_order(self):
+        s = self.server("--threads", "4")
+        n = 16
+        users = [s.client("u%d" % i) for i in range(n)]
+        for i, u in enumerate(users):
+            u.send("/pv u%d" % ((i + 1) % n))
+            u.expect("Private chat with")
+        for u in users:
+            for k in range(50):
+                u.send("m%d" % k)
+        for i, u in enumerate(users):
+            sender = "u%d" % ((i - 1) % n)
+            got = u.expect("%s (PV): m49\n" % sender, timeout=10)
+            self.assertEqual([l for l in got.split("\n") if "(PV)" in l],
+                             ["%s (PV): m%d" % (sender, k) for k in range(50)])
+
+    def check_room(self, *args):
+        s = self.server("--threads", "4", *args)
+        members = [s.client("u%d" % i) for i in range(12)]
+        for m in members:
+            m.send("/join big")
+        for m in members:
+            m.expect("You are now in room big.")
+        time.sleep(0.3)
+        for m in members:
+            m.read()
+        for m in members[:6]:
+            m.send(*["x-%d" % k for k in range(30)])
+        for i, m in enumerate(members):
+            got = chat_lines(m.read(quiet=0.3, timeout=10), "big")
+            for j in range(6):
+                seen = [t for name, t in got if name == "u%d" % j]
+                expected = [] if i == j else ["x-%d" % k for k in range(30)]
+                self.assertEqual(seen, expected, "u%d from u%d" % (i, j))
+
+    def test_room_chat_keeps_each_senders_order(self):
+        self.check_room()
+
+    def test_handed_off_fan_out_keeps_each_senders_order(self):
+        self.check_room("--fanout-inline", "4", "--fanout-chunk", "2")
+
+    def test_concurrent_sign_ins_claim_each_name_once(self):
+        s = self.server("--threads", "4")
+        won = []
+        lock = threading.Lock()
+
+        def try_name(name):
+            c = s.client()
+            c.send(name)
+            if "Hi " in c.read(quiet=0.3):
+                with lock:
+                    won.append(name)
+
+        names = ["n%d" % random.randrange(8) for _ in range(40)]
+        threads = [threading.Thread(target=try_name, args=(n,)) for n in names]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(sorted(won), sorted(set(names)))
+
+
+if __name__ == "__main__":
+    unittest.main()